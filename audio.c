@@ -1,95 +1,485 @@
+/*
+ * Audio processing unit (APU): two square wave channels (the first with a
+ * frequency sweep), a channel playing back wave RAM and a noise channel. The
+ * frame sequencer clocks the length counters (256 Hz), sweep (128 Hz) and
+ * volume envelopes (64 Hz).
+ *
+ * Instead of running the APU after every instruction, the cycles are only
+ * accumulated in audio_step. The APU catches up in one batch when enough cycles
+ * have passed, at the end of a frame, or right before a sound register is
+ * accessed (so the CPU always observes, and changes, the APU at the right
+ * point in time).
+ *
+ * Output is not generated by sampling the channels. Instead every change of a
+ * channel's output level is recorded at the exact cycle it happens in a
+ * band-limited step buffer (see blip.c), which produces the output samples.
+ */
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
 #include "audio.h"
+#include "blip.h"
 #include "hwdefs.h"
+#include "perf.h"
 
-int audio_init(struct gb_state *s) {
-    s->emu_state->audio_sndbuf = malloc(AUDIO_SNDBUF_SIZE * AUDIO_CHANNELS);
-    if (!s->emu_state->audio_sndbuf)
-        return 0;
-    memset(s->emu_state->audio_sndbuf, 0, AUDIO_SNDBUF_SIZE * AUDIO_CHANNELS);
+/* A channel at level 15 with NR50 volume 7 (*8) swings 15*8*48 = 5760, so the
+ * maximum of all channels combined is about 2/3 of s16. */
+static const int AUDIO_LEVEL_SCALE = 48;
+
+struct emu_audio_state {
+    struct blip_buf *blip;
+    u32 time; /* Cycles since the start of the current blip frame. */
+    int ch_out[4][2]; /* Last output (left/right) of each channel. */
+    int sample_rate; /* Nominal output rate. */
+    double rate_adjust; /* Applied to sample_rate at the next frame. */
+};
+
+int audio_init(struct gb_state *s, int sample_rate) {
+    s->emu_state->audio_buf = calloc(AUDIO_BUF_SIZE * AUDIO_CHANNELS,
+            sizeof(s16));
+    if (!s->emu_state->audio_buf)
+        return 1;
+
+    struct emu_audio_state *as = calloc(1, sizeof(struct emu_audio_state));
+    if (!as)
+        return 1;
+    s->emu_audio_state = as;
+
+    as->sample_rate = sample_rate;
+    as->rate_adjust = 1;
+    as->blip = blip_new(GB_FREQ, sample_rate, AUDIO_BUF_SIZE);
+    if (!as->blip)
+        return 1;
     return 0;
 }
 
-void audio_update(struct gb_state *s) {
-    const double sample_freq = 1. * AUDIO_SAMPLE_RATE / AUDIO_SNDBUF_SIZE;
+static u16 audio_freq(u8 lo, u8 hi) {
+    return lo | ((hi & 7) << 8);
+}
+
+/* NRx2: volume envelope of channel 1, 2 and 4. */
+static u8 audio_envelope_reg(struct gb_state *s, int i) {
+    switch (i) {
+    case 0: return s->io_sound_channel1_envelope;
+    case 1: return s->io_sound_channel2_envelope;
+    default: return s->io_sound_channel4_envelope;
+    }
+}
+
+/* NRx4: trigger and length enable. */
+static u8 audio_control_reg(struct gb_state *s, int i) {
+    switch (i) {
+    case 0: return s->io_sound_channel1_freq_hi;
+    case 1: return s->io_sound_channel2_freq_hi;
+    case 2: return s->io_sound_channel3_freq_hi;
+    default: return s->io_sound_channel4_consec_initial;
+    }
+}
+
+static bool audio_dac_enabled(struct gb_state *s, int i) {
+    if (i == 2)
+        return s->io_sound_channel3_enabled & (1<<7);
+    return audio_envelope_reg(s, i) & 0xf8;
+}
 
-    u8 *sndbuf = s->emu_state->audio_sndbuf;
+/* Cycles per step through the waveform (or per shift of the noise LFSR). */
+static u32 audio_period(struct gb_state *s, int i) {
+    switch (i) {
+    case 0:
+        return (2048 - audio_freq(s->io_sound_channel1_freq_lo,
+                                  s->io_sound_channel1_freq_hi)) * 4;
+    case 1:
+        return (2048 - audio_freq(s->io_sound_channel2_freq_lo,
+                                  s->io_sound_channel2_freq_hi)) * 4;
+    case 2:
+        return (2048 - audio_freq(s->io_sound_channel3_freq_lo,
+                                  s->io_sound_channel3_freq_hi)) * 2;
+    default:
+    {
+        u8 poly = s->io_sound_channel4_poly;
+        return GB_SND_NOISE_DIVISORS[poly & 7] << (poly >> 4);
+    }
+    }
+}
+
+/* Current output level (0-15) of a channel. */
+static u8 audio_channel_output(struct gb_state *s, int i) {
+    struct gb_sound_channel *ch = &s->io_sound_ch[i];
+
+    if (!ch->enabled)
+        return 0;
 
-    if (s->io_sound_channel2_freq_hi & (1<<7)) {
-        s->io_sound_channel2_freq_hi &= ~(1<<7);
-        s->io_sound_enabled |= (1<<1);
+    switch (i) {
+    case 0:
+    case 1:
+    {
+        u8 duty = (i == 0 ? s->io_sound_channel1_length_pattern :
+                            s->io_sound_channel2_length_pattern) >> 6;
+        return (GB_SND_DUTY_WAVES[duty] >> ch->pos) & 1 ? ch->volume : 0;
     }
+    case 2:
+    {
+        static const u8 level_shift[] = { 4, 0, 1, 2 };
+        u8 sample = s->io_sound_channel3_ram[ch->pos / 2];
+        sample = ch->pos & 1 ? sample & 0xf : sample >> 4;
+        return sample >> level_shift[(s->io_sound_channel3_level >> 5) & 3];
+    }
+    default:
+        return s->io_sound_ch4_lfsr & 1 ? 0 : ch->volume;
+    }
+}
 
-    u8 snd_enable = s->io_sound_enabled & (1<<7) ? 1 : 0;
-    u8 ch4_enable = s->io_sound_enabled & (1<<3) ? 1 : 0;
-    u8 ch3_enable = s->io_sound_enabled & (1<<2) ? 1 : 0;
-    u8 ch2_enable = s->io_sound_enabled & (1<<1) ? 1 : 0;
-    u8 ch1_enable = s->io_sound_enabled & (1<<0) ? 1 : 0;
+/* Next frequency of the sweep, disables channel 1 when it overflows. */
+static u16 audio_sweep_calc(struct gb_state *s) {
+    u8 sweep = s->io_sound_channel1_sweep;
+    u16 delta = s->io_sound_ch1_sweep_freq >> (sweep & 7);
+    u16 freq = sweep & (1<<3) ? s->io_sound_ch1_sweep_freq - delta :
+                                s->io_sound_ch1_sweep_freq + delta;
+    if (freq > 2047)
+        s->io_sound_ch[0].enabled = 0;
+    return freq;
+}
 
-    //printf("SND %d (%d %d %d %d)\n", snd_enable, ch1_enable, ch2_enable, ch3_enable, ch4_enable);
+static void audio_sweep_step(struct gb_state *s) {
+    u8 sweep = s->io_sound_channel1_sweep;
+    u8 period = (sweep >> 4) & 7;
 
-    if (!snd_enable)
+    if (s->io_sound_ch1_sweep_timer > 1) {
+        s->io_sound_ch1_sweep_timer--;
         return;
+    }
+    s->io_sound_ch1_sweep_timer = period ? period : 8;
 
-    if (!ch1_enable && !ch2_enable && !ch3_enable && !ch4_enable)
+    if (!s->io_sound_ch1_sweep_enabled || !period)
         return;
 
-    memset(sndbuf, 0, AUDIO_SNDBUF_SIZE * AUDIO_CHANNELS);
-
-    if (ch2_enable) {
-        static int env_step_cur = 0;
-        static int env_step_start = 0;
-        static int env_step_cyc_left = 0;
-        static int env_running = 0;
-        static int env_vol = 0;
-        /*u8 ch2_len = s->io_sound_channel2_length_pattern & 0x3f;*/
-        u8 ch2_duty = s->io_sound_channel2_length_pattern >> 6;
-        u8 ch2_use_len = s->io_sound_channel2_freq_hi & (1<<6) ? 1 : 0;
-        u8 ch2_vol = s->io_sound_channel2_envelope >> 4;
-        u8 ch2_env_step = s->io_sound_channel2_envelope & 0x7;
-        u8 ch2_env_inc = s->io_sound_channel2_envelope & (1<<3) ? 1 : 0;
-        u16 ch2_freq_reg = s->io_sound_channel2_freq_lo |
-                            ((s->io_sound_channel2_freq_hi & 7) << 8);
-        u32 freq = 131072/(2048-ch2_freq_reg);
-        u32 oscs_in_buf = freq / sample_freq;
-        u32 osc_len = AUDIO_SNDBUF_SIZE / oscs_in_buf;
-        u32 osc_high = osc_len * GB_SND_DUTY_PERC[ch2_duty];
-
-        if (ch2_env_step && (!env_running || env_step_start != ch2_env_step)) {
-            env_running = 1;
-            env_step_cur = ch2_env_step;
-            env_step_start = ch2_env_step;
-            env_step_cyc_left = GB_SND_ENVSTEP_CYC * ch2_env_step;
-            env_vol = ch2_vol;
-        } else if (env_running) {
-            /* TODO assumes we do this ones per frame */
-            env_step_cyc_left -= GB_FREQ/60.;
-            if (env_step_cyc_left <= 0) {
-                env_step_cur--;
-                env_vol += ch2_env_inc ? +1 : -1;
-                env_vol &= 0xf;
-                if (env_step_cur == 0) {
-                    env_running = 0;
-                } else {
-                    env_step_cyc_left = GB_SND_ENVSTEP_CYC * env_step_cur;
-                }
+    u16 freq = audio_sweep_calc(s);
+    if (freq <= 2047 && (sweep & 7)) {
+        s->io_sound_ch1_sweep_freq = freq;
+        s->io_sound_channel1_freq_lo = freq & 0xff;
+        s->io_sound_channel1_freq_hi =
+            (s->io_sound_channel1_freq_hi & ~7) | (freq >> 8);
+        audio_sweep_calc(s); /* Overflow check with the new frequency. */
+    }
+}
+
+static void audio_envelope_step(struct gb_sound_channel *ch, u8 envelope) {
+    u8 period = envelope & 7;
+
+    if (!period)
+        return;
+    if (ch->env_timer > 1) {
+        ch->env_timer--;
+        return;
+    }
+    ch->env_timer = period;
+
+    if (envelope & (1<<3)) {
+        if (ch->volume < 15)
+            ch->volume++;
+    } else if (ch->volume > 0) {
+        ch->volume--;
+    }
+}
+
+/* One step of the 512 Hz frame sequencer. */
+static void audio_frame_seq_step(struct gb_state *s) {
+    u8 step = s->io_sound_frame_seq_step;
+
+    if (step % 2 == 0) /* Length counters, 256 Hz */
+        for (int i = 0; i < 4; i++) {
+            struct gb_sound_channel *ch = &s->io_sound_ch[i];
+            if (ch->length && audio_control_reg(s, i) & (1<<6))
+                if (--ch->length == 0)
+                    ch->enabled = 0;
+        }
+
+    if (step == 2 || step == 6) /* Sweep, 128 Hz */
+        audio_sweep_step(s);
+
+    if (step == 7) { /* Envelopes, 64 Hz */
+        audio_envelope_step(&s->io_sound_ch[0], s->io_sound_channel1_envelope);
+        audio_envelope_step(&s->io_sound_ch[1], s->io_sound_channel2_envelope);
+        audio_envelope_step(&s->io_sound_ch[3], s->io_sound_channel4_envelope);
+    }
+
+    s->io_sound_frame_seq_step = (step + 1) & 7;
+}
+
+/* Record the change of the output of a channel (mixed according to NR50 and
+ * NR51) at the given time since the start of the blip frame, if any. */
+static void audio_channel_update(struct gb_state *s, int i, u32 time) {
+    struct emu_audio_state *as = s->emu_audio_state;
+    int out[2] = { 0, 0 };
+
+    if (!as)
+        return;
+
+    int level = audio_channel_output(s, i) * AUDIO_LEVEL_SCALE;
+    if (s->io_sound_out_terminal & (1 << (i + 4)))
+        out[0] = level * (((s->io_sound_terminal_control >> 4) & 7) + 1);
+    if (s->io_sound_out_terminal & (1 << i))
+        out[1] = level * ((s->io_sound_terminal_control & 7) + 1);
+
+    if (out[0] != as->ch_out[i][0] || out[1] != as->ch_out[i][1]) {
+        blip_add_delta(as->blip, time, out[0] - as->ch_out[i][0],
+                out[1] - as->ch_out[i][1]);
+        as->ch_out[i][0] = out[0];
+        as->ch_out[i][1] = out[1];
+    }
+}
+
+static void audio_update_all(struct gb_state *s, u32 time) {
+    for (int i = 0; i < 4; i++)
+        audio_channel_update(s, i, time);
+}
+
+/* Run the waveform of a channel for the given number of cycles, recording each
+ * step in the output starting at the given time. */
+static void audio_channel_run(struct gb_state *s, int i, u32 cycles,
+        u32 time) {
+    struct gb_sound_channel *ch = &s->io_sound_ch[i];
+
+    if (!ch->enabled)
+        return;
+
+    while (cycles >= ch->freq_timer) {
+        cycles -= ch->freq_timer;
+        time += ch->freq_timer;
+        ch->freq_timer = audio_period(s, i);
+        if (i == 3) {
+            u16 lfsr = s->io_sound_ch4_lfsr;
+            u16 bit = (lfsr ^ (lfsr >> 1)) & 1;
+            lfsr = (lfsr >> 1) | (bit << 14);
+            if (s->io_sound_channel4_poly & (1<<3)) /* 7-bit mode */
+                lfsr = (lfsr & ~(1<<6)) | (bit << 6);
+            s->io_sound_ch4_lfsr = lfsr;
+        } else {
+            ch->pos = (ch->pos + 1) & (i == 2 ? 31 : 7);
+        }
+        audio_channel_update(s, i, time);
+    }
+    ch->freq_timer -= cycles;
+}
+
+/* Run the APU for the given number of cycles. The channels run independently
+ * between frame sequencer steps, which may change their volume or stop them.
+ * Without audio output, only the frame sequencer is run: the waveforms are not
+ * visible through any register, but length, envelope and sweep are. */
+static void audio_run(struct gb_state *s, u32 cycles) {
+    struct emu_audio_state *as = s->emu_audio_state;
+    u32 time = as ? as->time : 0;
+
+    while (cycles) {
+        u32 step = cycles;
+        if (s->io_sound_frame_seq_cycles < step)
+            step = s->io_sound_frame_seq_cycles;
+
+        if (as)
+            for (int i = 0; i < 4; i++)
+                audio_channel_run(s, i, step, time);
+        time += step;
+        cycles -= step;
+
+        s->io_sound_frame_seq_cycles -= step;
+        if (s->io_sound_frame_seq_cycles == 0) {
+            s->io_sound_frame_seq_cycles = GB_SND_FRAME_SEQ_CLKS;
+            if (s->io_sound_enabled & (1<<7)) {
+                audio_frame_seq_step(s);
+                audio_update_all(s, time);
             }
         }
+    }
+
+    if (as)
+        as->time = time;
+}
+
+static void audio_sync(struct gb_state *s) {
+    struct perf_timer timer;
+    perf_begin(s->emu_state->perf, &timer);
+    audio_run(s, s->emu_state->audio_cycles);
+    s->emu_state->audio_cycles = 0;
+    perf_end(s->emu_state->perf, PERF_AUDIO, &timer);
+}
+
+void audio_step(struct gb_state *s) {
+    /* Without output nothing needs the APU until a register is accessed, so
+     * only catch up once in a while to keep audio_cycles from overflowing. */
+    u32 batch = s->emu_audio_state ? AUDIO_BATCH_CLKS : AUDIO_LAZY_CLKS;
+
+    s->emu_state->audio_cycles += s->emu_state->last_op_cycles;
+    if (s->emu_state->audio_cycles >= batch)
+        audio_sync(s);
+}
+
+void audio_end_frame(struct gb_state *s) {
+    struct emu_state *es = s->emu_state;
+    struct emu_audio_state *as = s->emu_audio_state;
+    struct perf_timer timer;
+
+    if (!as)
+        return;
+    audio_sync(s);
+
+    perf_begin(es->perf, &timer);
+    blip_end_frame(as->blip, as->time);
+    as->time = 0;
+    es->audio_buf_len += blip_read_samples(as->blip,
+            &es->audio_buf[es->audio_buf_len * AUDIO_CHANNELS],
+            AUDIO_BUF_SIZE - es->audio_buf_len);
+
+    /* The frame boundary is the only point where the ratio can change without
+     * shifting the deltas already in the buffer. */
+    blip_set_rates(as->blip, GB_FREQ, as->sample_rate * as->rate_adjust);
+    perf_end(es->perf, PERF_AUDIO, &timer);
+}
+
+void audio_set_rate_adjust(struct gb_state *s, double ratio) {
+    if (s->emu_audio_state)
+        s->emu_audio_state->rate_adjust = ratio;
+}
+
+static void audio_trigger(struct gb_state *s, int i) {
+    struct gb_sound_channel *ch = &s->io_sound_ch[i];
+
+    ch->enabled = audio_dac_enabled(s, i);
+    if (ch->length == 0)
+        ch->length = i == 2 ? 256 : 64;
+    ch->freq_timer = audio_period(s, i);
 
-        u8 vol = env_running ? env_vol : ch2_vol;
-        vol = 255 * vol / 16; /* Normalize to 0-255 */
-
-        /* TODO: envelope, length, restart */
-        if (vol) {
-            printf("CH3 duty=%x (%u%%) freq=%u (%u) vol=%u sw=%u ul=%d\n",
-                    ch2_duty, (int)(GB_SND_DUTY_PERC[ch2_duty]*100), freq,
-                    ch2_freq_reg, vol, ch2_env_step, ch2_use_len);
-            //printf(" oscs in buf: %u, len=%u samples, high=%u samples\n", oscs_in_buf, osc_len, osc_high);
-            for (u32 i = 0; i < oscs_in_buf; i++)
-                memset(&sndbuf[(i * osc_len)*2], vol, osc_high*2);
+    if (i == 2) {
+        ch->pos = 0;
+    } else {
+        u8 envelope = audio_envelope_reg(s, i);
+        ch->volume = envelope >> 4;
+        ch->env_timer = envelope & 7;
+    }
+
+    if (i == 3)
+        s->io_sound_ch4_lfsr = 0x7fff;
+
+    if (i == 0) {
+        u8 sweep = s->io_sound_channel1_sweep;
+        u8 period = (sweep >> 4) & 7;
+        s->io_sound_ch1_sweep_freq = audio_freq(s->io_sound_channel1_freq_lo,
+                s->io_sound_channel1_freq_hi);
+        s->io_sound_ch1_sweep_timer = period ? period : 8;
+        s->io_sound_ch1_sweep_enabled = period || (sweep & 7);
+        if (sweep & 7)
+            audio_sweep_calc(s);
+    }
+}
+
+/* The register at location (FF10-FF25), or NULL for unused addresses. */
+static u8 *audio_reg(struct gb_state *s, u16 location) {
+    switch (location) {
+    case 0xff10: return &s->io_sound_channel1_sweep;
+    case 0xff11: return &s->io_sound_channel1_length_pattern;
+    case 0xff12: return &s->io_sound_channel1_envelope;
+    case 0xff13: return &s->io_sound_channel1_freq_lo;
+    case 0xff14: return &s->io_sound_channel1_freq_hi;
+    case 0xff16: return &s->io_sound_channel2_length_pattern;
+    case 0xff17: return &s->io_sound_channel2_envelope;
+    case 0xff18: return &s->io_sound_channel2_freq_lo;
+    case 0xff19: return &s->io_sound_channel2_freq_hi;
+    case 0xff1a: return &s->io_sound_channel3_enabled;
+    case 0xff1b: return &s->io_sound_channel3_length;
+    case 0xff1c: return &s->io_sound_channel3_level;
+    case 0xff1d: return &s->io_sound_channel3_freq_lo;
+    case 0xff1e: return &s->io_sound_channel3_freq_hi;
+    case 0xff20: return &s->io_sound_channel4_length;
+    case 0xff21: return &s->io_sound_channel4_envelope;
+    case 0xff22: return &s->io_sound_channel4_poly;
+    case 0xff23: return &s->io_sound_channel4_consec_initial;
+    case 0xff24: return &s->io_sound_terminal_control;
+    case 0xff25: return &s->io_sound_out_terminal;
+    }
+    return NULL;
+}
+
+static void audio_write_reg(struct gb_state *s, u16 location, u8 value) {
+    if (location >= 0xff30) {
+        s->io_sound_channel3_ram[location - 0xff30] = value;
+        return;
+    }
+
+    if (location == 0xff26) {
+        if (!(value & (1<<7))) { /* Power off clears all registers. */
+            for (u16 l = 0xff10; l <= 0xff25; l++)
+                if (audio_reg(s, l))
+                    *audio_reg(s, l) = 0;
+            memset(s->io_sound_ch, 0, sizeof(s->io_sound_ch));
+        } else if (!(s->io_sound_enabled & (1<<7))) {
+            s->io_sound_frame_seq_step = 0;
         }
+        s->io_sound_enabled = value & (1<<7);
+        return;
     }
+
+    /* Registers can't be written while the APU is powered off. */
+    u8 *reg = audio_reg(s, location);
+    if (!reg || !(s->io_sound_enabled & (1<<7)))
+        return;
+    *reg = value;
+
+    if (location >= 0xff24) /* NR50, NR51 */
+        return;
+
+    int i = (location - 0xff10) / 5; /* NRxy is at FF10 + 5 * (x - 1) + y */
+    struct gb_sound_channel *ch = &s->io_sound_ch[i];
+    switch ((location - 0xff10) % 5) {
+    case 0: /* NR30: DAC power */
+        if (i == 2 && !(value & (1<<7)))
+            ch->enabled = 0;
+        break;
+    case 1: /* Length load */
+        ch->length = i == 2 ? 256 - value : 64 - (value & 0x3f);
+        break;
+    case 2: /* Envelope, writing 0 to the upper 5 bits turns off the DAC */
+        if (i != 2 && !(value & 0xf8))
+            ch->enabled = 0;
+        break;
+    case 4: /* Control */
+        if (value & (1<<7))
+            audio_trigger(s, i);
+        break;
+    }
+}
+
+void audio_write(struct gb_state *s, u16 location, u8 value) {
+    audio_sync(s);
+    audio_write_reg(s, location, value);
+    if (s->emu_audio_state)
+        audio_update_all(s, s->emu_audio_state->time);
+}
+
+u8 audio_read(struct gb_state *s, u16 location) {
+    /* Bits that can't be read back always read as 1. */
+    static const u8 read_mask[] = {
+        0x80, 0x3f, 0x00, 0xff, 0xbf, /* NR10-NR14 */
+        0xff, 0x3f, 0x00, 0xff, 0xbf, /* NR20-NR24 */
+        0x7f, 0xff, 0x9f, 0xff, 0xbf, /* NR30-NR34 */
+        0xff, 0xff, 0x00, 0x00, 0xbf, /* NR40-NR44 */
+        0x00, 0x00,                   /* NR50-NR51 */
+    };
+
+    if (location >= 0xff30)
+        return s->io_sound_channel3_ram[location - 0xff30];
+
+    if (location == 0xff26) {
+        audio_sync(s);
+        u8 status = (s->io_sound_enabled & (1<<7)) | 0x70;
+        for (int i = 0; i < 4; i++)
+            if (s->io_sound_ch[i].enabled)
+                status |= 1 << i;
+        return status;
+    }
+
+    u8 *reg = audio_reg(s, location);
+    if (!reg)
+        return 0xff;
+    return *reg | read_mask[location - 0xff10];
 }
@@ -5,9 +5,29 @@
 
 static const int AUDIO_SAMPLE_RATE = 44100; /* Hz */
 static const int AUDIO_CHANNELS = 2;
-static const int AUDIO_SNDBUF_SIZE = 1024; /* Per channel */
+static const int AUDIO_BUF_SIZE = 4096; /* Stereo samples, > 1 frame */
+static const int AUDIO_BATCH_CLKS = 16384; /* Max cycles before catching up */
+static const int AUDIO_LAZY_CLKS = 1 << 30; /* Same, without audio output */
 
-int audio_init(struct gb_state *s);
-void audio_update(struct gb_state *s);
+/* Set up audio output at the given sample rate. Without this, the APU runs in
+ * registers-only mode: no samples are generated, and the APU only catches up
+ * (lazily) when its registers are accessed, as far as they depend on it. */
+int audio_init(struct gb_state *s, int sample_rate);
+
+/* Account for the cycles of the last instruction. The APU only actually runs
+ * once enough cycles have passed, or when a sound register is accessed. */
+void audio_step(struct gb_state *s);
+
+/* Catch up and append all samples up to now to emu_state->audio_buf. */
+void audio_end_frame(struct gb_state *s);
+
+/* Generate ratio times as many samples per emulated second as the sample rate
+ * passed to audio_init, taking effect from the next frame on. Frontends use
+ * this to keep their output buffer from slowly running dry or filling up. */
+void audio_set_rate_adjust(struct gb_state *s, double ratio);
+
+/* Access to the sound registers (FF10-FF3F). */
+void audio_write(struct gb_state *s, u16 location, u8 value);
+u8 audio_read(struct gb_state *s, u16 location);
 
 #endif
@@ -0,0 +1,109 @@
+/*
+ * Runs ROMs (normally those made by romgen) for a fixed number of frames
+ * without GUI, audio or pacing, and reports how fast the emulator is.
+ *
+ * Usage: bench [-n FRAMES] ROM...
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "emu.h"
+#include "hwdefs.h"
+
+#define BENCH_WARMUP_FRAMES 60
+#define BENCH_DEFAULT_FRAMES 600
+
+struct bench_result {
+    double seconds;
+    double emu_seconds;
+    u64 instructions;
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double emulated_time(struct gb_state *s) {
+    return s->emu_state->time_seconds + 1. * s->emu_state->time_cycles / GB_FREQ;
+}
+
+static int bench_rom(char *filename, unsigned frames, struct bench_result *res) {
+    struct gb_state gb_state;
+    struct emu_args emu_args;
+
+    memset(&emu_args, 0, sizeof(emu_args));
+    emu_args.rom_filename = filename;
+    emu_args.no_save_load = 1;
+
+    if (emu_init(&gb_state, &emu_args))
+        return 1;
+
+    for (unsigned i = 0; i < BENCH_WARMUP_FRAMES; i++)
+        emu_step_frame(&gb_state);
+
+    u64 instructions = gb_state.emu_state->time_instructions;
+    double emu_start = emulated_time(&gb_state);
+    double start = now();
+    for (unsigned i = 0; i < frames; i++)
+        emu_step_frame(&gb_state);
+    res->seconds = now() - start;
+    res->emu_seconds = emulated_time(&gb_state) - emu_start;
+    res->instructions = gb_state.emu_state->time_instructions - instructions;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned frames = BENCH_DEFAULT_FRAMES;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n' && atoi(optarg) > 0)
+            frames = atoi(optarg);
+        else {
+            fprintf(stderr, "Usage: %s [-n FRAMES] ROM...\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("%-12s %10s %12s %10s %10s\n", "ROM", "frames/s", "ns/frame",
+            "MIPS", "speed");
+
+    for (int i = optind; i < argc; i++) {
+        struct bench_result res;
+        const char *name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1
+                                                 : argv[i];
+
+        /* Keep the emulator's own log output out of the results. */
+        fflush(stdout);
+        int saved_stdout = dup(STDOUT_FILENO);
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        close(devnull);
+
+        int err = bench_rom(argv[i], frames, &res);
+
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+
+        if (err) {
+            fprintf(stderr, "Couldn't run %s\n", argv[i]);
+            return 1;
+        }
+
+        printf("%-12s %10.1f %12.0f %10.2f %9.0f%%\n", name,
+                frames / res.seconds, res.seconds * 1e9 / frames,
+                res.instructions / res.seconds / 1e6,
+                100 * res.emu_seconds / res.seconds);
+    }
+    return 0;
+}
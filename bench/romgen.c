@@ -0,0 +1,406 @@
+/*
+ * Generates the synthetic benchmark ROMs, each stressing one part of the
+ * emulator. The ROMs are assembled by hand (opcodes are commented) and loop
+ * forever; bench runs them for a fixed number of frames.
+ *
+ * Usage: romgen DIR
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+
+#define ROM_BANKSIZE 0x4000
+
+struct rom {
+    u8 *data;
+    size_t size;
+    int pc; /* Where the next instruction is emitted (bank 0). */
+};
+
+#define E(r, ...) emit(r, (const u8[]){ __VA_ARGS__ }, \
+        sizeof((const u8[]){ __VA_ARGS__ }))
+#define LO(x) ((x) & 0xff)
+#define HI(x) (((x) >> 8) & 0xff)
+
+static void emit(struct rom *r, const u8 *bytes, size_t n) {
+    memcpy(&r->data[r->pc], bytes, n);
+    r->pc += n;
+}
+
+/* Relative jump (jr/jr cc, opcode op) back to target. */
+static void jr_to(struct rom *r, u8 op, int target) {
+    E(r, op, (u8)(target - (r->pc + 2)));
+}
+
+/* Point interrupt vector (0x40, 0x48, ...) to the code at target. */
+static void vector(struct rom *r, int vec, int target) {
+    r->data[vec] = 0xc3; /* jp nn */
+    r->data[vec + 1] = LO(target);
+    r->data[vec + 2] = HI(target);
+}
+
+/* Set up the header and fill all banks but the first with pseudo-random data
+ * (used as tiles, maps and copy sources). Code starts at 0x150. */
+static void rom_new(struct rom *r, int banks, bool cgb, u8 cart_type) {
+    static const u8 size_codes[] = { [2] = 0x00, [4] = 0x01, [8] = 0x02 };
+    u32 seed = 12345;
+
+    r->size = banks * ROM_BANKSIZE;
+    r->data = calloc(1, r->size);
+    for (size_t i = ROM_BANKSIZE; i < r->size; i++) {
+        seed = seed * 1103515245 + 12345;
+        r->data[i] = seed >> 16;
+    }
+
+    memcpy(&r->data[0x100], (u8[]){ 0x00, 0xc3, 0x50, 0x01 }, 4);
+    memcpy(&r->data[0x134], "BENCH", 5);
+    r->data[0x143] = cgb ? 0x80 : 0x00;
+    r->data[0x147] = cart_type;
+    r->data[0x148] = size_codes[banks];
+    r->data[0x149] = 0x00;
+
+    r->pc = 0x150;
+    E(r, 0xf3,                      /* di */
+         0x31, 0xfe, 0xff);         /* ld sp,$fffe */
+}
+
+static int rom_write(struct rom *r, const char *dir, const char *name,
+        bool cgb) {
+    char filename[1024];
+    snprintf(filename, sizeof(filename), "%s/%s.%s", dir, name,
+            cgb ? "gbc" : "gb");
+
+    FILE *f = fopen(filename, "wb");
+    if (!f || fwrite(r->data, 1, r->size, f) != r->size) {
+        fprintf(stderr, "Couldn't write %s\n", filename);
+        return 1;
+    }
+    fclose(f);
+    free(r->data);
+    return 0;
+}
+
+static void lcd_off(struct rom *r) {
+    E(r, 0xaf,                      /* xor a */
+         0xe0, 0x40);               /* ldh ($40),a */
+}
+
+/* Copy len (> 0) bytes from src to dst. */
+static void copy(struct rom *r, int src, int dst, int len) {
+    E(r, 0x21, LO(src), HI(src),    /* ld hl,src */
+         0x11, LO(dst), HI(dst),    /* ld de,dst */
+         0x01, LO(len), HI(len));   /* ld bc,len */
+    int loop = r->pc;
+    E(r, 0x2a,                      /* ld a,(hl+) */
+         0x12,                      /* ld (de),a */
+         0x13,                      /* inc de */
+         0x0b,                      /* dec bc */
+         0x78,                      /* ld a,b */
+         0xb1);                     /* or c */
+    jr_to(r, 0x20, loop);           /* jr nz,loop */
+}
+
+/* Tiles, BG map and window map from bank 1, and palettes. Expects the LCD to
+ * be off. Tile indices in the maps are limited to the 128 copied tiles. */
+static void setup_video(struct rom *r, bool cgb) {
+    for (int i = 0x4800; i < 0x5000; i++)
+        r->data[i] &= 0x7f;
+
+    copy(r, 0x4000, 0x8000, 0x800);
+    copy(r, 0x4800, 0x9800, 0x400);
+    copy(r, 0x4c00, 0x9c00, 0x400);
+
+    E(r, 0x3e, 0xe4,                /* ld a,$e4 */
+         0xe0, 0x47,                /* ldh ($47),a (BGP) */
+         0x3e, 0xd2,                /* ld a,$d2 */
+         0xe0, 0x48);               /* ldh ($48),a (OBP0) */
+
+    if (cgb) {
+        E(r, 0x3e, 0x80,            /* ld a,$80 */
+             0xe0, 0x68,            /* ldh ($68),a (BGPI, auto-increment) */
+             0xe0, 0x6a,            /* ldh ($6a),a (OBPI, auto-increment) */
+             0x06, 0x40);           /* ld b,64 */
+        int loop = r->pc;
+        E(r, 0x78,                  /* ld a,b */
+             0x07,                  /* rlca */
+             0xa8,                  /* xor b */
+             0xe0, 0x69,            /* ldh ($69),a (BGPD) */
+             0xe0, 0x6b,            /* ldh ($6b),a (OBPD) */
+             0x05);                 /* dec b */
+        jr_to(r, 0x20, loop);       /* jr nz,loop */
+    }
+}
+
+static void lcd_on(struct rom *r, u8 lcdc) {
+    E(r, 0x3e, lcdc,                /* ld a,lcdc */
+         0xe0, 0x40);               /* ldh ($40),a */
+}
+
+/* Register ALU operations and 16-bit arithmetic, LCD off. */
+static void gen_alu(struct rom *r) {
+    lcd_off(r);
+    E(r, 0x01, 0x34, 0x12,          /* ld bc,$1234 */
+         0x11, 0x78, 0x56,          /* ld de,$5678 */
+         0x21, 0xbc, 0x9a);         /* ld hl,$9abc */
+    int loop = r->pc;
+    E(r, 0x80,                      /* add a,b */
+         0x89,                      /* adc a,c */
+         0x92,                      /* sub d */
+         0x9b,                      /* sbc a,e */
+         0xa4,                      /* and h */
+         0xb5,                      /* or l */
+         0xa8,                      /* xor b */
+         0xb9,                      /* cp c */
+         0x3c,                      /* inc a */
+         0x05,                      /* dec b */
+         0x0c,                      /* inc c */
+         0x15,                      /* dec d */
+         0x1c,                      /* inc e */
+         0x25,                      /* dec h */
+         0x2c,                      /* inc l */
+         0x09,                      /* add hl,bc */
+         0x13,                      /* inc de */
+         0x0b,                      /* dec bc */
+         0x07,                      /* rlca */
+         0x1f,                      /* rra */
+         0x2f,                      /* cpl */
+         0x27,                      /* daa */
+         0xc6, 0x37,                /* add a,$37 */
+         0xee, 0x5a,                /* xor $5a */
+         0x47,                      /* ld b,a */
+         0x5f);                     /* ld e,a */
+    jr_to(r, 0x18, loop);           /* jr loop */
+}
+
+/* CB-prefixed rotates, shifts and bit operations on registers and (hl). */
+static void gen_cb(struct rom *r) {
+    lcd_off(r);
+    E(r, 0x21, 0x00, 0xc0,          /* ld hl,$c000 */
+         0x3e, 0x5a);               /* ld a,$5a */
+    int loop = r->pc;
+    E(r, 0xcb, 0x37,                /* swap a */
+         0xcb, 0x10,                /* rl b */
+         0xcb, 0x19,                /* rr c */
+         0xcb, 0x22,                /* sla d */
+         0xcb, 0x2b,                /* sra e */
+         0xcb, 0x3f,                /* srl a */
+         0xcb, 0x06,                /* rlc (hl) */
+         0xcb, 0x5e,                /* bit 3,(hl) */
+         0xcb, 0xee,                /* set 5,(hl) */
+         0xcb, 0xae,                /* res 5,(hl) */
+         0xcb, 0x7f,                /* bit 7,a */
+         0xcb, 0xc0,                /* set 0,b */
+         0xcb, 0x89,                /* res 1,c */
+         0xcb, 0x0b,                /* rrc e */
+         0xcb, 0x32);               /* swap d */
+    jr_to(r, 0x18, loop);           /* jr loop */
+}
+
+/* Copy 4K from each switchable ROM bank (MBC5) to each switchable WRAM bank
+ * (CGB), LCD off. */
+static void gen_memcpy(struct rom *r) {
+    lcd_off(r);
+    int outer = r->pc;
+    E(r, 0x0e, 0x01);               /* ld c,1 */
+    int bank = r->pc;
+    E(r, 0x79,                      /* ld a,c */
+         0xea, 0x00, 0x20,          /* ld ($2000),a (ROM bank) */
+         0xe0, 0x70,                /* ldh ($70),a (WRAM bank) */
+         0x21, 0x00, 0x40,          /* ld hl,$4000 */
+         0x11, 0x00, 0xd0,          /* ld de,$d000 */
+         0x06, 0x10);               /* ld b,16 */
+    int inner = r->pc;
+    E(r, 0x2a,                      /* ld a,(hl+) */
+         0x12,                      /* ld (de),a */
+         0x1c);                     /* inc e */
+    jr_to(r, 0x20, inner);          /* jr nz,inner */
+    E(r, 0x14,                      /* inc d */
+         0x05);                     /* dec b */
+    jr_to(r, 0x20, inner);          /* jr nz,inner */
+    E(r, 0x0c,                      /* inc c */
+         0x79,                      /* ld a,c */
+         0xfe, 0x08);               /* cp 8 */
+    jr_to(r, 0x20, bank);           /* jr nz,bank */
+    jr_to(r, 0x18, outer);          /* jr outer */
+}
+
+/* Alternate general-purpose DMA (2K at once) and H-Blank DMA (16 bytes per
+ * line) from four ROM areas to the tile data of alternating VRAM banks, with
+ * the LCD on so the changed tiles are rendered. */
+static void gen_hdma(struct rom *r) {
+    lcd_off(r);
+    setup_video(r, true);
+    lcd_on(r, 0x91);
+    E(r, 0x06, 0x40);               /* ld b,$40 */
+    int loop = r->pc;
+    E(r, 0x78,                      /* ld a,b */
+         0xc6, 0x08,                /* add a,$08 */
+         0xe6, 0x5f,                /* and $5f ($40-$58) */
+         0x47,                      /* ld b,a */
+         0xe0, 0x51,                /* ldh ($51),a (source high) */
+         0xaf,                      /* xor a */
+         0xe0, 0x52,                /* ldh ($52),a (source low) */
+         0xe0, 0x54,                /* ldh ($54),a (dest low) */
+         0xe0, 0x53,                /* ldh ($53),a (dest $8000) */
+         0xf0, 0x4f,                /* ldh a,($4f) */
+         0xee, 0x01,                /* xor 1 */
+         0xe0, 0x4f,                /* ldh ($4f),a (VRAM bank) */
+         0x3e, 0x7f,                /* ld a,$7f */
+         0xe0, 0x55,                /* ldh ($55),a (general DMA, 2K) */
+         0x3e, 0xff,                /* ld a,$ff */
+         0xe0, 0x55);               /* ldh ($55),a (H-Blank DMA, 2K) */
+    int wait = r->pc;
+    E(r, 0xf0, 0x55,                /* ldh a,($55) */
+         0x07);                     /* rlca */
+    jr_to(r, 0x30, wait);           /* jr nc,wait (until bit 7 set) */
+    jr_to(r, 0x18, loop);           /* jr loop */
+}
+
+/* 40 8x16 sprites, 10 on each line of four bands, moved every frame with OAM
+ * DMA. */
+static void gen_sprites(struct rom *r) {
+    for (int i = 0; i < 40; i++) {
+        u8 *obj = &r->data[0x7000 + i * 4];
+        obj[0] = 16 + (i / 10) * 32;
+        obj[1] = 8 + (i % 10) * 15;
+        obj[2] = (i * 2) & 0x7f;
+        obj[3] = (i & 1) << 5;      /* Some X-flipped */
+    }
+
+    lcd_off(r);
+    setup_video(r, false);
+    copy(r, 0x7000, 0xc000, 0xa0);
+
+    /* OAM DMA routine, assembled out of line and copied to HRAM. */
+    int main_pc = r->pc, dma = 0x3000;
+    r->pc = dma;
+    E(r, 0x3e, 0xc0,                /* ld a,$c0 */
+         0xe0, 0x46,                /* ldh ($46),a */
+         0x3e, 0x28);               /* ld a,40 */
+    int dma_wait = r->pc;
+    E(r, 0x3d);                     /* dec a */
+    jr_to(r, 0x20, dma_wait);       /* jr nz,dma_wait */
+    E(r, 0xc9);                     /* ret */
+    int dma_len = r->pc - dma;
+    r->pc = main_pc;
+    copy(r, dma, 0xff80, dma_len);
+
+    lcd_on(r, 0x97);                /* BG, 8x16 OBJ on, tiles at $8000 */
+    int loop = r->pc;
+    E(r, 0xf0, 0x44,                /* ldh a,($44) */
+         0xfe, 0x90);               /* cp 144 */
+    jr_to(r, 0x20, loop);           /* jr nz,loop (until V-Blank) */
+    E(r, 0x21, 0x01, 0xc0,          /* ld hl,$c001 */
+         0x06, 0x28);               /* ld b,40 */
+    int move = r->pc;
+    E(r, 0x34,                      /* inc (hl) (X) */
+         0x23, 0x23, 0x23, 0x23,    /* inc hl (x4) */
+         0x05);                     /* dec b */
+    jr_to(r, 0x20, move);           /* jr nz,move */
+    E(r, 0xcd, 0x80, 0xff);         /* call $ff80 */
+    int vblank = r->pc;
+    E(r, 0xf0, 0x44,                /* ldh a,($44) */
+         0xfe, 0x90);               /* cp 144 */
+    jr_to(r, 0x28, vblank);         /* jr z,vblank (until it ends) */
+    jr_to(r, 0x18, loop);           /* jr loop */
+}
+
+/* Window plus a per-line horizontal scroll (set from the H-Blank STAT
+ * interrupt) that changes every frame, with the CPU halted in between. */
+static void gen_raster(struct rom *r) {
+    lcd_off(r);
+    setup_video(r, false);
+    E(r, 0x3e, 0x48,                /* ld a,72 */
+         0xe0, 0x4a,                /* ldh ($4a),a (WY) */
+         0x3e, 0x57,                /* ld a,87 */
+         0xe0, 0x4b,                /* ldh ($4b),a (WX) */
+         0x3e, 0x08,                /* ld a,$08 */
+         0xe0, 0x41,                /* ldh ($41),a (STAT: H-Blank int) */
+         0x3e, 0x03,                /* ld a,$03 */
+         0xe0, 0xff,                /* ldh ($ff),a (IE: V-Blank, STAT) */
+         0xaf,                      /* xor a */
+         0xe0, 0x80,                /* ldh ($80),a (frame counter) */
+         0xe0, 0x0f);               /* ldh ($0f),a (IF) */
+    lcd_on(r, 0xf1);                /* BG, window (map $9c00), tiles $8000 */
+    E(r, 0xfb);                     /* ei */
+    int loop = r->pc;
+    E(r, 0x76);                     /* halt */
+    jr_to(r, 0x18, loop);           /* jr loop */
+
+    vector(r, 0x40, r->pc);
+    E(r, 0xf5,                      /* push af */
+         0xf0, 0x80,                /* ldh a,($80) */
+         0x3c,                      /* inc a */
+         0xe0, 0x80,                /* ldh ($80),a */
+         0xe0, 0x42,                /* ldh ($42),a (SCY) */
+         0xf1,                      /* pop af */
+         0xd9);                     /* reti */
+
+    vector(r, 0x48, r->pc);
+    E(r, 0xf5,                      /* push af */
+         0xc5,                      /* push bc */
+         0xf0, 0x44,                /* ldh a,($44) */
+         0x47,                      /* ld b,a */
+         0xf0, 0x80,                /* ldh a,($80) */
+         0x80,                      /* add a,b */
+         0xe0, 0x43,                /* ldh ($43),a (SCX) */
+         0xc1,                      /* pop bc */
+         0xf1,                      /* pop af */
+         0xd9);                     /* reti */
+}
+
+/* A static screen with the CPU halted until every V-Blank. */
+static void gen_halt(struct rom *r) {
+    lcd_off(r);
+    setup_video(r, false);
+    E(r, 0x3e, 0x01,                /* ld a,$01 */
+         0xe0, 0xff,                /* ldh ($ff),a (IE: V-Blank) */
+         0xaf,                      /* xor a */
+         0xe0, 0x0f);               /* ldh ($0f),a (IF) */
+    lcd_on(r, 0x91);
+    E(r, 0xfb);                     /* ei */
+    int loop = r->pc;
+    E(r, 0x76);                     /* halt */
+    jr_to(r, 0x18, loop);           /* jr loop */
+
+    vector(r, 0x40, r->pc);
+    E(r, 0xd9);                     /* reti */
+}
+
+int main(int argc, char *argv[]) {
+    static const struct {
+        const char *name;
+        void (*gen)(struct rom *r);
+        int banks;
+        bool cgb;
+        u8 cart_type;
+    } roms[] = {
+        { "alu",     gen_alu,     2, false, 0x00 },
+        { "cb",      gen_cb,      2, false, 0x00 },
+        { "memcpy",  gen_memcpy,  8, true,  0x19 }, /* MBC5 */
+        { "hdma",    gen_hdma,    2, true,  0x00 },
+        { "sprites", gen_sprites, 2, false, 0x00 },
+        { "raster",  gen_raster,  2, false, 0x00 },
+        { "halt",    gen_halt,    2, false, 0x00 },
+    };
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s DIR\n", argv[0]);
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(roms) / sizeof(roms[0]); i++) {
+        struct rom r;
+        rom_new(&r, roms[i].banks, roms[i].cgb, roms[i].cart_type);
+        roms[i].gen(&r);
+        if (rom_write(&r, argv[1], roms[i].name, roms[i].cgb))
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * Band-limited step synthesis (BLEP). Every delta is added to the buffer as a
+ * short windowed-sinc impulse (the derivative of a band-limited step), placed
+ * with sub-sample precision by picking one of BLIP_PHASES precomputed kernels.
+ * Reading integrates the impulses back into a signal. The integrator leaks a
+ * little every sample, which acts as the high-pass filter that removes the DC
+ * offset (like the capacitor on the GameBoy's audio output).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "blip.h"
+
+#define BLIP_PHASE_BITS 5
+#define BLIP_PHASES (1 << BLIP_PHASE_BITS)
+#define BLIP_TAPS 16
+
+static const double BLIP_PI = 3.14159265358979323846;
+static const double BLIP_CUTOFF = 0.45; /* Relative to output rate. */
+static const double BLIP_HPF_HZ = 28.; /* Corner frequency of high-pass. */
+
+struct blip_buf {
+    u64 factor; /* Output samples per clock, 32.32 fixed point. */
+    u64 offset; /* Position of the start of the frame in buf, 32.32. */
+    int size; /* Max samples per frame. */
+    int avail; /* Complete samples, not yet read. */
+    float charge; /* Integrator leak per sample. */
+    float sum[2]; /* Integrator, left/right. */
+    float kernel[BLIP_PHASES][BLIP_TAPS];
+    float buf[]; /* Interleaved stereo, size + BLIP_TAPS + 1 samples. */
+};
+
+struct blip_buf *blip_new(u32 clock_rate, u32 sample_rate, int max_samples) {
+    size_t buf_size = (max_samples + BLIP_TAPS + 1) * 2 * sizeof(float);
+    struct blip_buf *b = calloc(1, sizeof(struct blip_buf) + buf_size);
+    if (!b)
+        return NULL;
+
+    blip_set_rates(b, clock_rate, sample_rate);
+    b->size = max_samples;
+    b->charge = exp(-2 * BLIP_PI * BLIP_HPF_HZ / sample_rate);
+
+    for (int p = 0; p < BLIP_PHASES; p++) {
+        double sum = 0;
+        for (int t = 0; t < BLIP_TAPS; t++) {
+            /* Distance (in samples) from the step, Blackman windowed. */
+            double x = t - (BLIP_TAPS / 2 - 1) - 1. * p / BLIP_PHASES;
+            double a = 2 * BLIP_PI * BLIP_CUTOFF * x;
+            double sinc = x == 0 ? 1 : sin(a) / a;
+            double w = 0.42 + 0.5 * cos(2 * BLIP_PI * x / BLIP_TAPS) +
+                0.08 * cos(4 * BLIP_PI * x / BLIP_TAPS);
+            b->kernel[p][t] = sinc * w;
+            sum += sinc * w;
+        }
+        for (int t = 0; t < BLIP_TAPS; t++)
+            b->kernel[p][t] /= sum;
+    }
+
+    return b;
+}
+
+void blip_set_rates(struct blip_buf *b, double clock_rate, double sample_rate) {
+    b->factor = sample_rate / clock_rate * 4294967296.;
+}
+
+void blip_free(struct blip_buf *b) {
+    free(b);
+}
+
+void blip_add_delta(struct blip_buf *b, u32 time, int delta_l, int delta_r) {
+    u64 pos = b->offset + time * b->factor;
+    int i = pos >> 32;
+
+    if (i > b->size)
+        return;
+
+    int phase = (pos >> (32 - BLIP_PHASE_BITS)) & (BLIP_PHASES - 1);
+    float *kernel = b->kernel[phase];
+    float *out = &b->buf[i * 2];
+    for (int t = 0; t < BLIP_TAPS; t++) {
+        out[t * 2 + 0] += kernel[t] * delta_l;
+        out[t * 2 + 1] += kernel[t] * delta_r;
+    }
+}
+
+int blip_end_frame(struct blip_buf *b, u32 clocks) {
+    b->offset += clocks * b->factor;
+    b->avail = b->offset >> 32;
+    if (b->avail > b->size) {
+        b->avail = b->size;
+        b->offset = (u64)b->size << 32;
+    }
+    return b->avail;
+}
+
+int blip_read_samples(struct blip_buf *b, s16 *out, int max_samples) {
+    int n = b->avail < max_samples ? b->avail : max_samples;
+
+    for (int i = 0; i < n; i++)
+        for (int c = 0; c < 2; c++) {
+            float v = b->sum[c] = b->sum[c] * b->charge + b->buf[i * 2 + c];
+            if (v > 32767)
+                v = 32767;
+            if (v < -32768)
+                v = -32768;
+            out[i * 2 + c] = v;
+        }
+
+    /* Keep the tails of the steps that overlap the next samples. */
+    int left = b->avail - n + BLIP_TAPS + 1;
+    memmove(b->buf, &b->buf[n * 2], left * 2 * sizeof(float));
+    memset(&b->buf[left * 2], 0, n * 2 * sizeof(float));
+    b->offset -= (u64)n << 32;
+    b->avail -= n;
+    return n;
+}
@@ -0,0 +1,36 @@
+#ifndef BLIP_H
+#define BLIP_H
+
+#include "types.h"
+
+/*
+ * Band-limited step buffer: instead of sampling a signal at the output rate,
+ * the changes (deltas) of the signal are recorded at the exact (clock) time
+ * they happen, as a band-limited step. Reading the buffer integrates these
+ * steps, giving an alias-free signal at any output sample rate.
+ */
+struct blip_buf;
+
+/* Buffer converting from clock_rate (Hz) to sample_rate (Hz), holding at most
+ * max_samples (stereo) output samples per frame. */
+struct blip_buf *blip_new(u32 clock_rate, u32 sample_rate, int max_samples);
+void blip_free(struct blip_buf *b);
+
+/* Change the conversion ratio, e.g. to slightly speed up or slow down the
+ * output. Only call this between frames. The high-pass filter keeps using the
+ * original sample_rate, which is fine for small changes. */
+void blip_set_rates(struct blip_buf *b, double clock_rate, double sample_rate);
+
+/* Add a step of delta_l/delta_r to the output at time clocks since the start
+ * of the current frame. */
+void blip_add_delta(struct blip_buf *b, u32 time, int delta_l, int delta_r);
+
+/* End the current frame after the given number of clocks. Returns the number of
+ * samples that are now complete and can be read. */
+int blip_end_frame(struct blip_buf *b, u32 clocks);
+
+/* Read (at most max_samples) complete interleaved stereo samples. Returns the
+ * number of samples read. */
+int blip_read_samples(struct blip_buf *b, s16 *out, int max_samples);
+
+#endif
@@ -0,0 +1,236 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "breakpoint.h"
+#include "mmu.h"
+
+static const char *bp_reg_names[] = {
+    "a", "f", "b", "c", "d", "e", "h", "l",
+    "af", "bc", "de", "hl", "sp", "pc",
+};
+#define BP_NUM_REGS (sizeof(bp_reg_names) / sizeof(bp_reg_names[0]))
+
+static const char *bp_op_names[] = {
+    [BP_COND_EQ] = "==", [BP_COND_NE] = "!=",
+    [BP_COND_LT] = "<",  [BP_COND_LE] = "<=",
+    [BP_COND_GT] = ">",  [BP_COND_GE] = ">=",
+};
+
+struct breakpoints *bp_new(void) {
+    struct breakpoints *b = calloc(1, sizeof(struct breakpoints));
+    if (!b)
+        return NULL;
+    b->next_id = 1;
+    return b;
+}
+
+/* Recompute which addresses and pages have any breakpoint. */
+static void bp_update_maps(struct breakpoints *b) {
+    memset(b->exec_map, 0, sizeof(b->exec_map));
+    memset(b->watch_pages, 0, sizeof(b->watch_pages));
+    for (int i = 0; i < b->num; i++) {
+        struct breakpoint *bp = &b->list[i];
+        for (u32 addr = bp->start; addr <= bp->end; addr++) {
+            if (bp->kind & BP_EXEC)
+                b->exec_map[addr >> 3] |= 1 << (addr & 7);
+            b->watch_pages[addr >> 8] |= bp->kind & (BP_READ | BP_WRITE);
+        }
+    }
+
+    b->vectors = 0;
+    for (u16 vector = 0x40; vector <= 0x60; vector += 8)
+        b->vectors |= bp_exec_marked(b, vector);
+}
+
+int bp_add(struct breakpoints *b, int kind, int bank, u16 start, u16 end,
+        const struct bp_cond *cond) {
+    if (b->num == b->max) {
+        int max = b->max ? b->max * 2 : 16;
+        struct breakpoint *list = realloc(b->list,
+                max * sizeof(struct breakpoint));
+        if (!list)
+            return -1;
+        b->list = list;
+        b->max = max;
+    }
+
+    struct breakpoint *bp = &b->list[b->num++];
+    bp->id = b->next_id++;
+    bp->kind = kind;
+    bp->bank = bank;
+    bp->start = start;
+    bp->end = end < start ? start : end;
+    if (cond)
+        bp->cond = *cond;
+    else
+        bp->cond.op = BP_COND_NONE;
+    bp_update_maps(b);
+    return bp->id;
+}
+
+int bp_remove(struct breakpoints *b, int id, int kind, u16 start, u16 end) {
+    int removed = 0;
+    for (int i = 0; i < b->num; ) {
+        struct breakpoint *bp = &b->list[i];
+        if (id >= 0 ? bp->id == id : bp->kind == kind && bp->start == start &&
+                bp->end == end) {
+            b->list[i] = b->list[--b->num];
+            removed++;
+        } else
+            i++;
+    }
+    bp_update_maps(b);
+    return removed;
+}
+
+static void bp_print(struct breakpoint *bp) {
+    printf("%3d %s%s%s ", bp->id, bp->kind & BP_EXEC ? "break" : "watch ",
+            bp->kind & BP_READ ? "r" : "", bp->kind & BP_WRITE ? "w" : "");
+    if (bp->bank != BP_ANY_BANK)
+        printf("%02x:", bp->bank);
+    printf("%04x", bp->start);
+    if (bp->end != bp->start)
+        printf("-%04x", bp->end);
+    if (bp->cond.op != BP_COND_NONE) {
+        if (bp->cond.reg >= 0)
+            printf(" if %s", bp_reg_names[bp->cond.reg]);
+        else
+            printf(" if [%04x]", bp->cond.addr);
+        printf(" %s %x", bp_op_names[bp->cond.op], bp->cond.value);
+    }
+    printf("\n");
+}
+
+void bp_list(struct breakpoints *b) {
+    if (!b->num)
+        printf("No breakpoints or watchpoints.\n");
+    for (int i = 0; i < b->num; i++)
+        bp_print(&b->list[i]);
+}
+
+int bp_parse_cond(const char *str, struct bp_cond *cond) {
+    char *end;
+
+    while (isspace(*str))
+        str++;
+    if (*str == '[') {
+        cond->reg = -1;
+        cond->addr = strtol(str + 1, &end, 16);
+        if (end == str + 1 || *end != ']')
+            return 1;
+        str = end + 1;
+    } else {
+        size_t len = 0;
+        while (isalpha(str[len]))
+            len++;
+        cond->reg = -1;
+        for (size_t i = 0; i < BP_NUM_REGS; i++)
+            if (strlen(bp_reg_names[i]) == len &&
+                    !strncmp(str, bp_reg_names[i], len))
+                cond->reg = i;
+        if (cond->reg < 0)
+            return 1;
+        str += len;
+    }
+
+    while (isspace(*str))
+        str++;
+    cond->op = BP_COND_NONE;
+    for (int op = BP_COND_EQ; op <= BP_COND_GE; op++) {
+        size_t len = strlen(bp_op_names[op]);
+        /* Prefer "<=" over "<". */
+        if (!strncmp(str, bp_op_names[op], len) &&
+                (cond->op == BP_COND_NONE ||
+                 len > strlen(bp_op_names[cond->op])))
+            cond->op = op;
+    }
+    if (cond->op == BP_COND_NONE)
+        return 1;
+    str += strlen(bp_op_names[cond->op]);
+
+    cond->value = strtol(str, &end, 16);
+    if (end == str)
+        return 1;
+    while (isspace(*end))
+        end++;
+    return *end != '\0';
+}
+
+bool bp_eval_cond(struct gb_state *s, const struct bp_cond *cond) {
+    u16 lhs;
+
+    if (cond->op == BP_COND_NONE)
+        return 1;
+
+    switch (cond->reg) {
+    case -1: lhs = mmu_read(s, cond->addr); break;
+    case 0: lhs = s->reg8.A; break;
+    case 1: lhs = s->reg8.F; break;
+    case 2: lhs = s->reg8.B; break;
+    case 3: lhs = s->reg8.C; break;
+    case 4: lhs = s->reg8.D; break;
+    case 5: lhs = s->reg8.E; break;
+    case 6: lhs = s->reg8.H; break;
+    case 7: lhs = s->reg8.L; break;
+    case 8: lhs = s->reg16.AF; break;
+    case 9: lhs = s->reg16.BC; break;
+    case 10: lhs = s->reg16.DE; break;
+    case 11: lhs = s->reg16.HL; break;
+    case 12: lhs = s->sp; break;
+    default: lhs = s->pc; break;
+    }
+
+    switch (cond->op) {
+    case BP_COND_EQ: return lhs == cond->value;
+    case BP_COND_NE: return lhs != cond->value;
+    case BP_COND_LT: return lhs < cond->value;
+    case BP_COND_LE: return lhs <= cond->value;
+    case BP_COND_GT: return lhs > cond->value;
+    case BP_COND_GE: return lhs >= cond->value;
+    default: return 1;
+    }
+}
+
+static bool bp_matches(struct gb_state *s, struct breakpoint *bp, int kind,
+        u16 addr) {
+    return (bp->kind & kind) && addr >= bp->start && addr <= bp->end &&
+        (bp->bank == BP_ANY_BANK || bp->bank == mmu_bank(s, addr)) &&
+        bp_eval_cond(s, &bp->cond);
+}
+
+bool bp_check_exec(struct breakpoints *b, struct gb_state *s, u16 pc) {
+    for (int i = 0; i < b->num; i++) {
+        if (bp_matches(s, &b->list[i], BP_EXEC, pc)) {
+            if (!b->quiet)
+                printf("Breakpoint %d hit%s\n", b->list[i].id,
+                        pc != s->pc ? " (interrupt)" : "");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+bool bp_check_watch(struct breakpoints *b, struct gb_state *s, int kind,
+        u16 addr, u8 value) {
+    if (!b->armed)
+        return 0;
+
+    /* Conditions may read memory, which shouldn't trigger watchpoints. */
+    b->armed = 0;
+    bool hit = 0;
+    for (int i = 0; i < b->num && !hit; i++) {
+        if (bp_matches(s, &b->list[i], kind, addr)) {
+            if (!b->quiet)
+                printf("Watchpoint %d hit: %s %02x:%04x = %02x\n",
+                        b->list[i].id, kind == BP_READ ? "read" : "write",
+                        mmu_bank(s, addr), addr, value);
+            b->watch_hit = b->list[i].kind;
+            b->watch_hit_addr = addr;
+            hit = 1;
+        }
+    }
+    b->armed = 1;
+    return hit;
+}
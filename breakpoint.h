@@ -0,0 +1,100 @@
+#ifndef BREAKPOINT_H
+#define BREAKPOINT_H
+
+#include "types.h"
+#include "cpu.h"
+
+/*
+ * Breakpoints (on execution) and watchpoints (on memory reads/writes), each
+ * optionally limited to a bank and with a condition. Which addresses have any
+ * breakpoint is kept in a bitmap, and which pages (256 bytes) have any
+ * watchpoint in a table, so the common case costs a single test. Only checked
+ * in debug builds.
+ */
+#define BP_EXEC  (1 << 0)
+#define BP_READ  (1 << 1)
+#define BP_WRITE (1 << 2)
+
+#define BP_ANY_BANK -1
+
+enum bp_cond_op {
+    BP_COND_NONE,
+    BP_COND_EQ,
+    BP_COND_NE,
+    BP_COND_LT,
+    BP_COND_LE,
+    BP_COND_GT,
+    BP_COND_GE,
+};
+
+/* `lhs op value`, where lhs is a register or a byte in memory. */
+struct bp_cond {
+    enum bp_cond_op op;
+    int reg; /* Index into the register names, or -1 for memory at addr. */
+    u16 addr;
+    u16 value;
+};
+
+struct breakpoint {
+    int id;
+    int kind; /* BP_EXEC, or BP_READ and/or BP_WRITE. */
+    int bank; /* See mmu_bank, or BP_ANY_BANK. */
+    u16 start, end; /* Inclusive. */
+    struct bp_cond cond;
+};
+
+struct breakpoints {
+    u8 exec_map[0x10000 / 8];
+    u8 watch_pages[0x100]; /* BP_READ and/or BP_WRITE. */
+    bool vectors; /* Breakpoints on interrupt vectors, see bp_exec_pc. */
+    bool armed; /* Watchpoints only trigger while emulating, not debugging. */
+    bool quiet; /* Don't print hits (while replaying for reverse execution). */
+    int watch_hit; /* Kind of the watchpoint that triggered the break, or 0. */
+    u16 watch_hit_addr;
+
+    struct breakpoint *list;
+    int num, max;
+    int next_id;
+};
+
+struct breakpoints *bp_new(void);
+
+/* Returns the id of the new breakpoint, or -1 on failure. */
+int bp_add(struct breakpoints *b, int kind, int bank, u16 start, u16 end,
+        const struct bp_cond *cond);
+
+/* Remove by id, or (with id -1) all of the given kind at exactly start-end.
+ * Returns the number removed. */
+int bp_remove(struct breakpoints *b, int id, int kind, u16 start, u16 end);
+
+void bp_list(struct breakpoints *b);
+
+/* Parse a condition such as "a == 3", "hl >= c000" or "[ff44] != 90" (hex
+ * values). Returns 1 on a syntax error. */
+int bp_parse_cond(const char *str, struct bp_cond *cond);
+bool bp_eval_cond(struct gb_state *s, const struct bp_cond *cond);
+
+/* Slow paths, only called for marked addresses and pages. They return
+ * whether to break (printing which breakpoint hit). */
+bool bp_check_exec(struct breakpoints *b, struct gb_state *s, u16 pc);
+bool bp_check_watch(struct breakpoints *b, struct gb_state *s, int kind,
+        u16 addr, u8 value);
+
+static inline bool bp_exec_marked(struct breakpoints *b, u16 pc) {
+    return b->exec_map[pc >> 3] & (1 << (pc & 7));
+}
+
+/* The first instruction executed by the next cpu_step, which is the handler
+ * (not s->pc) when it dispatches an interrupt. */
+static inline u16 bp_exec_pc(struct breakpoints *b, struct gb_state *s) {
+    u16 vector;
+    if (b->vectors && (vector = cpu_next_interrupt(s)))
+        return vector;
+    return s->pc;
+}
+
+static inline bool bp_watch_marked(struct breakpoints *b, int kind, u16 addr) {
+    return b->watch_pages[addr >> 8] & kind;
+}
+
+#endif
@@ -173,6 +173,14 @@ void cpu_reset_state(struct gb_state *s) {
     s->io_sound_channel4_poly = 0x00;
     s->io_sound_channel4_consec_initial = 0xbf;
 
+    memset(s->io_sound_ch, 0, sizeof(s->io_sound_ch));
+    s->io_sound_ch1_sweep_freq = 0;
+    s->io_sound_ch1_sweep_timer = 0;
+    s->io_sound_ch1_sweep_enabled = 0;
+    s->io_sound_ch4_lfsr = 0x7fff;
+    s->io_sound_frame_seq_step = 0;
+    s->io_sound_frame_seq_cycles = GB_SND_FRAME_SEQ_CLKS;
+
 
     s->mem_bank_rom = 1;
     s->mem_bank_wram = 1;
@@ -216,6 +224,16 @@ static void cpu_handle_interrupts(struct gb_state *s) {
     }
 }
 
+u16 cpu_next_interrupt(struct gb_state *s) {
+    u8 interrupts = s->interrupts_enable & s->interrupts_request;
+
+    if (s->interrupts_master_enabled)
+        for (int i = 0; i < 5; i++)
+            if (interrupts & (1 << i))
+                return i * 0x8 + 0x40;
+    return 0;
+}
+
 void cpu_timers_step(struct gb_state *s) {
     u32 freq = s->double_speed ? GB_FREQ : 2 * GB_FREQ;
     u32 div_cycles_per_tick = freq / GB_DIV_FREQ;
@@ -740,6 +758,7 @@ void cpu_step(struct gb_state *s) {
 
     if (!s->halt_for_interrupts)
         cpu_do_instruction(s);
+#ifndef NDEBUG
     else
         if (!s->interrupts_enable)
             cpu_error("Waiting for interrupts while disabled, deadlock.\n");
@@ -750,4 +769,5 @@ void cpu_step(struct gb_state *s) {
         cpu_error("PC in external RAM: %.4x\n", s->pc);
     else if (s->pc >= 0xe000 && s->pc < 0xff80)
         cpu_error("PC in ECHO/OAM/IO/unusable: %.4x\n", s->pc);
+#endif
 }
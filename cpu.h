@@ -8,4 +8,15 @@ void cpu_reset_state(struct gb_state *s);
 void cpu_step(struct gb_state *s);
 void cpu_timers_step(struct gb_state *s);
 
+/* The interrupt vector cpu_step will jump to before executing an instruction,
+ * or 0 if it won't dispatch an interrupt. */
+u16 cpu_next_interrupt(struct gb_state *s);
+
+/* Whether cpu_step will execute an instruction: not while halted, unless a
+ * pending interrupt wakes the CPU up first. */
+static inline bool cpu_executes(struct gb_state *s) {
+    return !s->halt_for_interrupts ||
+        (s->interrupts_enable & s->interrupts_request);
+}
+
 #endif
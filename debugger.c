@@ -7,6 +7,9 @@
 #include "debugger.h"
 #include "disassembler.h"
 #include "mmu.h"
+#include "breakpoint.h"
+#include "gdbstub.h"
+#include "reverse.h"
 
 void dbg_print_regs(struct gb_state *s) {
     printf("\n\tAF\tBC\tDE\tHL\tSP\tPC\t\tLY\tZNHC\n");
@@ -15,9 +18,47 @@ void dbg_print_regs(struct gb_state *s) {
             s->io_lcd_LY, s->flags.ZF, s->flags.NF, s->flags.HF, s->flags.CF);
 }
 
+/*
+ * Parse "[bank:]loc[-end] [if cond]" (hex) for breakpoints and watchpoints.
+ * Returns 1 on a syntax error.
+ */
+static int dbg_parse_bp(const char *str, int *bank, u16 *start, u16 *end,
+        struct bp_cond *cond) {
+    char *p;
+    long val = strtol(str, &p, 16);
+
+    if (p == str)
+        return 1;
+    *bank = BP_ANY_BANK;
+    if (*p == ':') {
+        *bank = val;
+        str = p + 1;
+        val = strtol(str, &p, 16);
+        if (p == str)
+            return 1;
+    }
+    *start = *end = val;
+    if (*p == '-') {
+        str = p + 1;
+        *end = strtol(str, &p, 16);
+        if (p == str || *end < *start)
+            return 1;
+    }
+
+    cond->op = BP_COND_NONE;
+    while (*p == ' ')
+        p++;
+    if (!strncmp(p, "if ", 3))
+        return bp_parse_cond(p + 3, cond);
+    return *p != '\0';
+}
+
 int dbg_run_debugger(struct gb_state *s) {
     static char last_exec_cmd = 0;
 
+    if (s->emu_state->gdb)
+        return gdb_run(s->emu_state->gdb, s);
+
     printf("Break, next instruction: ");
     disassemble(s);
 
@@ -28,7 +69,7 @@ int dbg_run_debugger(struct gb_state *s) {
         add_history(raw_input);
 
         /* Copy into buffer that is automatically free'd on function exit. */
-        char input[32];
+        char input[64];
         strncpy(input, raw_input, sizeof(input));
         input[sizeof(input) - 1] = '\0';
         free(raw_input);
@@ -43,9 +84,30 @@ int dbg_run_debugger(struct gb_state *s) {
             return 0;
         }
 
+        /* Release builds have no breakpoints and emu_step doesn't check
+         * dbg_break_next there, so only inspecting and continuing work. */
+        if (!s->emu_state->breakpoints && strchr("bwlus", input[0])) {
+            printf("'%c' needs a debug build\n", input[0]);
+            continue;
+        }
 
         switch (input[0]) {
-        case 'r': /* Regs - Print all regs */
+        case 'r':
+            if (input[1] == 's' || input[1] == 'c') {
+                /* Reverse step/continue - go back in time */
+                struct reverse *r = s->emu_state->reverse;
+                if (!r)
+                    printf("No history, enable it with --reverse\n");
+                else if (!(input[1] == 's' ? reverse_step(r, s) :
+                            reverse_continue(r, s))) {
+                    printf("Now at step %llu: ",
+                            (unsigned long long)s->emu_state->time_steps);
+                    disassemble(s);
+                }
+                break;
+            }
+            /* Regs - Print all regs */
+            /* fall through */
         case 'p':
             dbg_print_regs(s);
             break;
@@ -73,9 +135,40 @@ int dbg_run_debugger(struct gb_state *s) {
             return 0;
 
         case 'b': /* Breakpoint - place new breakpoint */
+        case 'w': /* Watchpoint - break on memory access */
         {
-            u16 loc = strtol(&input[2], NULL, 16);
-            s->emu_state->dbg_breakpoint = loc;
+            int kind = BP_EXEC, bank, id;
+            const char *args = &input[1];
+            struct bp_cond cond;
+            u16 start, end;
+
+            if (input[0] == 'w') {
+                kind = input[1] == 'r' ? BP_READ :
+                       input[1] == 'a' ? BP_READ | BP_WRITE : BP_WRITE;
+                if (input[1] == 'r' || input[1] == 'a')
+                    args++;
+            }
+            if (*args != ' ' || dbg_parse_bp(args + 1, &bank, &start, &end,
+                        &cond)) {
+                printf("Invalid location or condition\n");
+                break;
+            }
+            id = bp_add(s->emu_state->breakpoints, kind, bank, start, end,
+                    &cond);
+            if (id >= 0)
+                printf("Added %s %d\n", kind == BP_EXEC ? "breakpoint" :
+                        "watchpoint", id);
+            break;
+        }
+        case 'l': /* List breakpoints */
+            bp_list(s->emu_state->breakpoints);
+            break;
+
+        case 'u': /* Unset - remove breakpoint */
+        {
+            int id = strtol(&input[1], NULL, 10);
+            if (!bp_remove(s->emu_state->breakpoints, id, 0, 0, 0))
+                printf("No breakpoint %d\n", id);
             break;
         }
         case 'q': /* Quit */
@@ -87,9 +180,19 @@ int dbg_run_debugger(struct gb_state *s) {
             printf(" r     - [P]rint all [r]egisters (alias: p)\n");
             printf(" x loc - E[x]amine memory at `loc`\n");
             printf(" d loc - [D]isassemble memory at `loc`\n");
-            printf(" b loc - Place a [b]reakpoint at PC `loc`\n");
+            printf(" b [bank:]loc [if cond]\n");
+            printf("       - Place a [b]reakpoint at PC `loc`, only in `bank` and if\n");
+            printf("         `cond` (e.g. `a == 3`, `hl >= c000`, `[ff44] != 90`)\n");
+            printf(" w [bank:]loc[-end] [if cond]\n");
+            printf("       - Place a [w]atchpoint on writes to `loc`-`end`,\n");
+            printf("         `wr` for reads and `wa` for both\n");
+            printf(" l     - [L]ist breakpoints and watchpoints\n");
+            printf(" u id  - [U]nset (remove) breakpoint or watchpoint `id`\n");
             printf(" s     - [S]tep: execute single instruction\n");
             printf(" c     - [C]ontinue executiong until next breakpoint\n");
+            printf(" rs    - [R]everse [s]tep: go back one instruction\n");
+            printf(" rc    - [R]everse [c]ontinue: go back to the previous\n");
+            printf("         breakpoint or watchpoint hit\n");
             printf(" q     - [Q]uit emulator\n");
             printf(" h     - Show [h]elp\n");
             break;
@@ -1,6 +1,7 @@
 #include "disassembler.h"
 
 #include <stdio.h>
+#include <stdarg.h>
 
 #include "mmu.h"
 
@@ -108,16 +109,34 @@ static GBOPCODE cbOpcodes[] = {
 };
 
 
-int disassemble_pc(struct gb_state* s, u16 pc) {
-    u16 oldpc = pc;
-    u8 opcode = mmu_read(s, pc++);
+/* Append to the output buffer of disassemble_bytes, truncating if full. */
+static void dis_printf(char *buf, size_t buflen, size_t *pos,
+        const char *fmt, ...) {
+    va_list ap;
+
+    if (*pos >= buflen)
+        return;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + *pos, buflen - *pos, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        *pos += n;
+}
+
+int disassemble_bytes(const u8 *bytes, char *buf, size_t buflen) {
+    int len = 0;
+    size_t pos = 0;
+    u8 opcode = bytes[len++];
     GBOPCODE *op = NULL;
     const char *mnem = NULL;
 
+    if (buflen)
+        buf[0] = '\0';
+
     if (opcode == 0xcb) {
         /* extended instruction */
         op = cbOpcodes;
-        opcode = mmu_read(s, pc++);
+        opcode = bytes[len++];
     } else {
         op = opcodes;
     }
@@ -129,71 +148,81 @@ int disassemble_pc(struct gb_state* s, u16 pc) {
     u8 temp1, temp2;
     s8 stemp;
 
-    if (oldpc >= 0x4000 && oldpc < 0x8000)
-        printf("(%x:%.4x)  ", s->mem_bank_rom, oldpc); /* TODO: MBC1 upper bits */
-    else
-        printf("(%.4x)  ", oldpc);
-
     while (*mnem) {
         if (*mnem == '%') {
             mnem++;
             switch(*mnem) {
             case 'B': /* Single byte */
-                temp1 = mmu_read(s, pc++);
-                printf("0x%x", temp1);
+                temp1 = bytes[len++];
+                dis_printf(buf, buflen, &pos, "0x%x", temp1);
                 break;
             case 'W': /* Word (two bytes) */
-                temp1 = mmu_read(s, pc++);
-                temp2 = mmu_read(s, pc++);
-                printf("0x%x", temp1 | (temp2 << 8));
+                temp1 = bytes[len++];
+                temp2 = bytes[len++];
+                dis_printf(buf, buflen, &pos, "0x%x", temp1 | (temp2 << 8));
                 break;
             case 'd': /* Signed displacement (one byte) */
-                stemp = mmu_read(s, pc++);
-                printf("%d", stemp);
+                stemp = bytes[len++];
+                dis_printf(buf, buflen, &pos, "%d", stemp);
                 break;
             case 'n': /* Single byte, no 0x prefix */
-                temp1 = mmu_read(s, pc++);
-                printf("%02x", temp1);
+                temp1 = bytes[len++];
+                dis_printf(buf, buflen, &pos, "%02x", temp1);
                 break;
             case 'r': /* Register name */
                 temp1 = *(++mnem) - '0';
-                printf("%s", registers[(opcode >> temp1) & 7]);
+                dis_printf(buf, buflen, &pos, "%s",
+                        registers[(opcode >> temp1) & 7]);
                 break;
             case 'R': /* 16 bit register name (double reg) */
                 temp1 = *(++mnem) - '0';
-                printf("%s", registers16[(opcode >> temp1) & 3]);
+                dis_printf(buf, buflen, &pos, "%s",
+                        registers16[(opcode >> temp1) & 3]);
                 break;
             case 't': /* 16 bit register name (double reg) for push/pop */
                 temp1 = *(++mnem) - '0';
-                printf("%s", registers16[4 + ((opcode >> temp1) & 3)]);
+                dis_printf(buf, buflen, &pos, "%s",
+                        registers16[4 + ((opcode >> temp1) & 3)]);
                 break;
             case 'c': /* condition flag name */
                 temp1 = *(++mnem) - '0';
-                printf("%s", conditions[(opcode >> temp1) & 3]);
+                dis_printf(buf, buflen, &pos, "%s",
+                        conditions[(opcode >> temp1) & 3]);
                 break;
             case 'b': /* bit number of CB bit instruction */
                 temp1 = (opcode >> 3) & 7;
-                printf("%x", temp1);
+                dis_printf(buf, buflen, &pos, "%x", temp1);
                 break;
             case 'P': /* RST address */
                 temp1 = ((opcode >> 3) & 7) * 8;
-                printf("0x%x", temp1);
+                dis_printf(buf, buflen, &pos, "0x%x", temp1);
                 break;
             default:
-                printf("%%%c", *mnem);
+                dis_printf(buf, buflen, &pos, "%%%c", *mnem);
             }
         } else {
-            putc(*mnem, stdout);
+            dis_printf(buf, buflen, &pos, "%c", *mnem);
         }
         mnem++;
     }
-    /*
-    printf("\t\t");
-    for (int i = 0; i < pc - oldpc; i++)
-        printf(" %02x", mmu_read(s, oldpc + i));
-    */
-    putc('\n', stdout);
-    return pc - oldpc;
+    return len;
+}
+
+int disassemble_pc(struct gb_state* s, u16 pc) {
+    u8 bytes[DISASSEMBLE_MAX_LEN];
+    char buf[64];
+
+    for (int i = 0; i < DISASSEMBLE_MAX_LEN; i++)
+        bytes[i] = mmu_read(s, pc + i);
+
+    if (pc >= 0x4000 && pc < 0x8000)
+        printf("(%x:%.4x)  ", s->mem_bank_rom, pc); /* TODO: MBC1 upper bits */
+    else
+        printf("(%.4x)  ", pc);
+
+    int len = disassemble_bytes(bytes, buf, sizeof(buf));
+    printf("%s\n", buf);
+    return len;
 }
 
 void disassemble(struct gb_state* state) {
@@ -1,8 +1,16 @@
 #ifndef DISASSEMBLER_H
 #define DISASSEMBLER_H
 
+#include <stddef.h>
+
 #include "types.h"
 
+#define DISASSEMBLE_MAX_LEN 3 /* Bytes of the longest instruction. */
+
+/* Write the instruction at bytes (DISASSEMBLE_MAX_LEN available) as text to
+ * buf. Returns the length of the instruction. */
+int disassemble_bytes(const u8 *bytes, char *buf, size_t buflen);
+
 int disassemble_pc(struct gb_state* state, u16 pc);
 void disassemble(struct gb_state* state);
 void disassemble_bootblock(struct gb_state *state);
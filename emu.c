@@ -12,8 +12,13 @@
 #include "audio.h"
 #include "disassembler.h"
 #include "debugger.h"
+#include "breakpoint.h"
 #include "gui.h"
 #include "fileio.h"
+#include "hash.h"
+#include "profile.h"
+#include "trace.h"
+#include "reverse.h"
 
 #define emu_error(fmt, ...) \
     do { \
@@ -22,42 +27,64 @@
     } while (0)
 
 void emu_save(struct gb_state *s, char extram, char *out_filename) {
+    struct perf_timer timer;
     u8 *state_buf;
     size_t state_buf_size;
 
     if (extram && !s->has_extram)
         return;
 
+    perf_begin(s->emu_state->perf, &timer);
     if (extram)
         state_save_extram(s, &state_buf, &state_buf_size);
     else
         state_save(s, &state_buf, &state_buf_size);
 
     save_file(out_filename, state_buf, state_buf_size);
+    perf_end(s->emu_state->perf, PERF_STATE, &timer);
 
     printf("%s saved to \"%s\".\n", extram ? "Ext RAM" : "State", out_filename);
 }
 
 int emu_init(struct gb_state *s, struct emu_args *args) {
+    struct perf *perf = NULL;
+    struct perf_timer timer;
+
     memset(s, 0, sizeof(struct gb_state));
 
 
+    /* Before loading, so that is measured as well. */
+    if (args->perf && !(perf = perf_new()))
+        emu_error("Couldn't initialize time measurement");
+
     if (!args->rom_filename)
         emu_error("Must specify ROM filename");
     if (strlen(args->rom_filename) >
             sizeof(s->emu_state->state_filename_out) - 6)
         emu_error("ROM filename too long (%s)", args->rom_filename);
 
-    if (args->state_filename) {
-        printf("Loading savestate from \"%s\" ...\n", args->state_filename);
-        u8 *state_buf;
-        size_t state_buf_size;
-        if (read_file(args->state_filename, &state_buf, &state_buf_size))
-            emu_error("Error during reading of state file \"%s\".\n",
+    if (args->state_filename || args->state_buf) {
+        u8 *state_buf = args->state_buf;
+        size_t state_buf_size = args->state_buf_size;
+        perf_begin(perf, &timer);
+        if (!state_buf) {
+            printf("Loading savestate from \"%s\" ...\n",
                     args->state_filename);
+            if (read_file(args->state_filename, &state_buf, &state_buf_size))
+                emu_error("Error during reading of state file \"%s\".\n",
+                        args->state_filename);
+        }
 
         if (state_load(s, state_buf, state_buf_size))
             emu_error("Error during loading of state, aborting.\n");
+        perf_end(perf, PERF_STATE, &timer);
+
+        /* These still point into the emulator that saved the state. */
+        s->mem_BIOS = NULL;
+        s->emu_state = NULL;
+        s->emu_cpu_state = NULL;
+        s->emu_lcd_state = NULL;
+        s->emu_audio_state = NULL;
 
         print_rom_header_info(s->mem_ROM);
 
@@ -84,7 +111,10 @@ int emu_init(struct gb_state *s, struct emu_args *args) {
             state_add_bios(s, bios, bios_size);
         }
 
-        if (args->save_filename) {
+        perf_begin(perf, &timer);
+        if (args->no_save_load) {
+            /* Start with a cleared cartridge RAM, e.g. for movies. */
+        } else if (args->save_filename) {
             u8 *state_buf;
             size_t state_buf_size;
             if (read_file(args->save_filename, &state_buf, &state_buf_size))
@@ -102,6 +132,7 @@ int emu_init(struct gb_state *s, struct emu_args *args) {
                 if (state_load_extram(s, state_buf, state_buf_size))
                     emu_error("Error during loading of save.\n");
         }
+        perf_end(perf, PERF_STATE, &timer);
     }
     init_emu_state(s);
     cpu_init_emu_cpu_state(s);
@@ -113,14 +144,27 @@ int emu_init(struct gb_state *s, struct emu_args *args) {
             sizeof(s->emu_state->state_filename_out), "%sstate",
             args->rom_filename);
 
+    /* Before lcd_init, which may start the render thread. */
+    s->emu_state->perf = perf;
+
+    s->emu_state->lcd_render_mode = args->render_mode;
     if (lcd_init(s))
         emu_error("Couldn't initialize LCD");
 
     if (args->audio_enable) {
-        if (audio_init(s))
+        if (audio_init(s, args->audio_sample_rate ? args->audio_sample_rate :
+                    AUDIO_SAMPLE_RATE))
             emu_error("Couldn't initialize audio");
     }
 
+#ifdef NDEBUG
+    if (args->break_at_start || args->print_disas || args->print_mmu ||
+            args->reverse_interval)
+        emu_error("Debugger options need a debug build");
+#else
+    if (!(s->emu_state->breakpoints = bp_new()))
+        emu_error("Couldn't initialize breakpoints");
+#endif
     if (args->break_at_start)
         s->emu_state->dbg_break_next = 1;
     if (args->print_disas)
@@ -129,31 +173,70 @@ int emu_init(struct gb_state *s, struct emu_args *args) {
         s->emu_state->dbg_print_mmu = 1;
     if (args->audio_enable)
         s->emu_state->audio_enable = 1;
+    if (args->profile && !(s->emu_state->profile = profile_new()))
+        emu_error("Couldn't initialize profiler");
+    if (args->trace_filename) {
+        s->emu_state->trace = trace_open(args->trace_filename,
+                args->trace_records ? args->trace_records :
+                TRACE_DEFAULT_RECORDS, args->trace_mmu);
+        if (!s->emu_state->trace)
+            emu_error("Couldn't start trace");
+        s->emu_state->trace_mmu = args->trace_mmu;
+    }
+    if (args->reverse_interval &&
+            !(s->emu_state->reverse = reverse_new(args->reverse_interval)))
+        emu_error("Couldn't initialize reverse execution");
     return 0;
 }
 
-void emu_step(struct gb_state *s) {
-    if (s->emu_state->dbg_print_disas)
-        disassemble(s);
-
-    if (s->emu_state->dbg_break_next ||
-        s->pc == s->emu_state->dbg_breakpoint)
-        if (dbg_run_debugger(s)) {
-            s->emu_state->quit = 1;
-            return;
-        }
+/* The emulated hardware, without any of the debugging and tracing hooks. */
+static void emu_step_machine(struct gb_state *s) {
+    if (cpu_executes(s))
+        s->emu_state->time_instructions++;
+    s->emu_state->time_steps++;
 
+#ifndef NDEBUG
+    s->emu_state->breakpoints->armed = 1;
+#endif
     cpu_step(s);
     lcd_step(s);
     mmu_step(s);
     cpu_timers_step(s);
+    audio_step(s);
+#ifndef NDEBUG
+    s->emu_state->breakpoints->armed = 0;
+#endif
 
     s->emu_state->time_cycles += s->emu_state->last_op_cycles;
     if (s->emu_state->time_cycles >= GB_FREQ) {
         s->emu_state->time_cycles %= GB_FREQ;
         s->emu_state->time_seconds++;
     }
+}
+
+void emu_step(struct gb_state *s) {
+#ifndef NDEBUG
+    struct breakpoints *bps = s->emu_state->breakpoints;
+    u16 pc = bp_exec_pc(bps, s);
+
+    if (s->emu_state->dbg_print_disas)
+        disassemble(s);
+
+    if (s->emu_state->dbg_break_next ||
+        (bp_exec_marked(bps, pc) && bp_check_exec(bps, s, pc)))
+        if (dbg_run_debugger(s)) {
+            s->emu_state->quit = 1;
+            return;
+        }
+#endif
+
+    if (s->emu_state->trace)
+        trace_step(s->emu_state->trace, s);
+
+    emu_step_machine(s);
 
+    if (s->emu_state->trace)
+        trace_end_step(s->emu_state->trace);
 
     if (s->emu_state->make_savestate) {
         s->emu_state->make_savestate = 0;
@@ -168,14 +251,137 @@ void emu_step(struct gb_state *s) {
     }
 }
 
+void emu_step_replay(struct gb_state *s) {
+    emu_step_machine(s);
+}
+
+u64 emu_cycles(struct gb_state *s) {
+    return (u64)s->emu_state->time_seconds * GB_FREQ +
+        s->emu_state->time_cycles;
+}
+
+static bool emu_limit_reached(struct gb_state *s, u64 cycles,
+        u64 instructions) {
+    return (cycles && emu_cycles(s) >= cycles) ||
+        (instructions && s->emu_state->time_instructions >= instructions);
+}
+
 void emu_step_frame(struct gb_state *s) {
-    do {
-        emu_step(s);
-    } while (!s->emu_state->lcd_entered_vblank);
+    emu_step_frame_until(s, 0, 0);
+}
+
+int emu_step_frame_until(struct gb_state *s, u64 cycles, u64 instructions) {
+    struct perf *perf = s->emu_state->perf;
+    struct perf_timer timer;
+    bool reached = 0;
+    u64 start = emu_cycles(s);
+
+    /* Only check the limits per instruction if this frame may reach them.
+     * Frames vary in length (mode switches, DMA), so allow for twice the last
+     * one. Every instruction takes at least 4 cycles. */
+    u64 window = s->emu_state->frame_cycles;
+    if (window < (u64)GB_LCD_FRAME_CLKS)
+        window = GB_LCD_FRAME_CLKS;
+    window *= 2;
+    bool near = (cycles && cycles <= start + window) ||
+        (instructions &&
+         instructions <= s->emu_state->time_instructions + window / 4);
+
+    if (perf)
+        perf_frame(perf);
+    perf_begin(perf, &timer);
+
+    s->emu_state->audio_buf_len = 0;
+
+    if (s->emu_state->reverse)
+        reverse_frame(s->emu_state->reverse, s);
+
+    /* Separate loops so the profiler and limits cost nothing when unused. */
+    if (near) {
+        while (!(reached = emu_limit_reached(s, cycles, instructions))) {
+            if (s->emu_state->profile)
+                profile_pre_step(s->emu_state->profile, s);
+            emu_step(s);
+            if (s->emu_state->profile)
+                profile_post_step(s->emu_state->profile, s);
+            if (s->emu_state->lcd_entered_vblank || s->emu_state->quit)
+                break;
+        }
+    } else if (s->emu_state->profile) {
+        do {
+            profile_pre_step(s->emu_state->profile, s);
+            emu_step(s);
+            profile_post_step(s->emu_state->profile, s);
+        } while (!s->emu_state->lcd_entered_vblank && !s->emu_state->quit);
+    } else {
+        do {
+            emu_step(s);
+        } while (!s->emu_state->lcd_entered_vblank && !s->emu_state->quit);
+    }
+
+    audio_end_frame(s);
 
     /* Save periodically (once per frame) if dirty. */
     s->emu_state->flush_extram = 1;
 
+    s->emu_state->frame_cycles = emu_cycles(s) - start;
+
+    perf_end(perf, PERF_CPU, &timer);
+    return reached;
+}
+
+void emu_set_render_skip(struct gb_state *s, bool skip) {
+    s->emu_state->lcd_render_skip = skip;
+}
+
+void emu_profile_report(struct gb_state *s, unsigned top,
+        const char *folded_filename) {
+    if (!s->emu_state->profile)
+        return;
+    profile_report(s->emu_state->profile, s, top);
+    if (folded_filename)
+        profile_write_folded(s->emu_state->profile, folded_filename);
+}
+
+int emu_perf_stats(struct gb_state *s, enum perf_counter c,
+        struct perf_stats *stats) {
+    if (!s->emu_state->perf)
+        return 1;
+    perf_stats(s->emu_state->perf, c, stats);
+    return 0;
+}
+
+void emu_set_audio_rate_adjust(struct gb_state *s, double ratio) {
+    audio_set_rate_adjust(s, ratio);
+}
+
+u64 emu_hash_framebuffer(struct gb_state *s) {
+    return hash_buf(s->emu_state->lcd_pixbuf,
+            GB_LCD_WIDTH * GB_LCD_HEIGHT * sizeof(u16), 0);
+}
+
+u64 emu_hash_state(struct gb_state *s) {
+    /* Everything in struct gb_state except the pointers, which differ per run
+     * (the struct is zeroed by emu_init, so the padding is deterministic). The
+     * ROM and BIOS can't change, so aren't included. */
+    struct gb_state machine = *s;
+    machine.mem_ROM = NULL;
+    machine.mem_WRAM = NULL;
+    machine.mem_EXTRAM = NULL;
+    machine.mem_VRAM = NULL;
+    machine.mem_BIOS = NULL;
+    machine.emu_state = NULL;
+    machine.emu_cpu_state = NULL;
+    machine.emu_lcd_state = NULL;
+    machine.emu_audio_state = NULL;
+
+    u64 h = hash_buf(&machine, sizeof(machine), 0);
+    h = hash_buf(s->mem_WRAM, s->mem_num_banks_wram * WRAM_BANKSIZE, h);
+    h = hash_buf(s->mem_VRAM, s->mem_num_banks_vram * VRAM_BANKSIZE, h);
+    if (s->mem_EXTRAM)
+        h = hash_buf(s->mem_EXTRAM,
+                s->mem_num_banks_extram * EXTRAM_BANKSIZE, h);
+    return h;
 }
 
 void emu_process_inputs(struct gb_state *s, struct player_input *input) {
@@ -206,4 +412,7 @@ void emu_process_inputs(struct gb_state *s, struct player_input *input) {
     BTN(dirs,     right,   0);
 
 #undef BTN
+
+    if (s->emu_state->reverse)
+        reverse_input(s->emu_state->reverse, s);
 }
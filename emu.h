@@ -3,22 +3,74 @@
 
 #include "types.h"
 #include "player_input.h"
+#include "perf.h"
 
 struct emu_args {
     char *rom_filename;
     char *bios_filename;
     char *state_filename;
+    u8 *state_buf; /* In-memory savestate, used instead of state_filename. */
+    size_t state_buf_size;
     char *save_filename;
+    char no_save_load; /* Start with cleared battery-backed RAM. */
     char break_at_start;
     char print_disas;
     char print_mmu;
     char audio_enable;
+    char profile; /* Profile guest code, see emu_profile_report. */
+    char perf; /* Measure host time per part, see emu_perf_stats. */
+    char *trace_filename; /* Binary execution trace (see trace.h). */
+    u64 trace_records; /* Size of the trace ring, TRACE_DEFAULT_RECORDS if 0. */
+    char trace_mmu; /* Also trace memory accesses. */
+    unsigned reverse_interval; /* Frames between snapshots for reverse
+                                  execution, 0 to disable (see reverse.h). */
+    int audio_sample_rate; /* Hz, AUDIO_SAMPLE_RATE if 0. */
+    enum lcd_render_mode render_mode;
 };
 
 int emu_init(struct gb_state *s, struct emu_args *args);
 void emu_step(struct gb_state *s);
 void emu_step_frame(struct gb_state *s);
+
+/* emu_step_frame, but stop early at the first instruction boundary where the
+ * total emulated cycles or executed instructions reach the given limit (0 for
+ * none). The limits are only checked per instruction during the frame in which
+ * they may be reached. Returns 1 if a limit was reached. */
+int emu_step_frame_until(struct gb_state *s, u64 cycles, u64 instructions);
+
+/* Total number of cycles emulated (at the normal-speed clock, GB_FREQ). */
+u64 emu_cycles(struct gb_state *s);
+
+/* emu_step without the debugger hooks, traces and saving, to replay
+ * execution (see reverse.h). */
+void emu_step_replay(struct gb_state *s);
 void emu_process_inputs(struct gb_state *s, struct player_input *input_state);
 void emu_save(struct gb_state *s, char extram, char *out_filename);
 
+/* Skip rendering of LCD lines (e.g., for frameskip or fast-forward). All LCD
+ * timing, STAT and interrupt behavior is still emulated, but lcd_pixbuf is not
+ * updated while skipping. */
+void emu_set_render_skip(struct gb_state *s, bool skip);
+
+/* Nudge the audio resampling ratio (e.g., 1.005 for 0.5% more samples) for
+ * dynamic rate control by the frontend. */
+void emu_set_audio_rate_adjust(struct gb_state *s, double ratio);
+
+/* Print the hottest guest functions and instructions (top of each), and write
+ * the call stacks for flamegraph tools to folded_filename (unless NULL). Only
+ * if emu_args.profile was set. */
+void emu_profile_report(struct gb_state *s, unsigned top,
+        const char *folded_filename);
+
+/* Host time per frame spent in one part of the emulator (or the frontend).
+ * Returns 1 if emu_args.perf wasn't set. */
+int emu_perf_stats(struct gb_state *s, enum perf_counter c,
+        struct perf_stats *stats);
+
+/* 64-bit hashes of the current frame (lcd_pixbuf), and of the emulated
+ * machine: registers, I/O, WRAM, VRAM, OAM, HRAM and cartridge RAM. These are
+ * cheap enough (a few us) to compare runs every frame, e.g. for determinism. */
+u64 emu_hash_framebuffer(struct gb_state *s);
+u64 emu_hash_state(struct gb_state *s);
+
 #endif
@@ -0,0 +1,172 @@
+/*
+ * Trace format, integers are little-endian:
+ *   header: "GBFT", u16 width, u16 height
+ *   per frame: u64 rolling hash, a bitmap of changed rows (bit y%8 of byte
+ *   y/8), and the pixels of every changed row (u16, host byte order).
+ * The rolling hash of frame n is the hash of the hash of frame n, seeded with
+ * the rolling hash of frame n-1 (0 before the first frame), so two traces
+ * match up to and including frame n iff the rolling hashes of frame n match.
+ * The first frame is compared against an all-zero frame.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fbtrace.h"
+#include "hash.h"
+
+#define FBTRACE_WIDTH 160
+#define FBTRACE_HEIGHT 144
+#define FBTRACE_MAP_BYTES ((FBTRACE_HEIGHT + 7) / 8)
+#define FBTRACE_ROW_BYTES (FBTRACE_WIDTH * sizeof(u16))
+
+struct fbtrace {
+    FILE *out;
+    FILE *golden;
+    unsigned frame;
+    u64 frame_hash; /* Of the last frame. */
+    u64 hash; /* Rolling hash up to the last frame. */
+    u16 prev[FBTRACE_WIDTH * FBTRACE_HEIGHT];
+    u16 golden_fb[FBTRACE_WIDTH * FBTRACE_HEIGHT]; /* Replayed golden frame. */
+};
+
+static void fbtrace_write_le(FILE *f, u64 value, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        fputc((value >> (i * 8)) & 0xff, f);
+}
+
+static int fbtrace_read_le(FILE *f, u64 *value, int bytes) {
+    u8 buf[8];
+    if (fread(buf, 1, bytes, f) != (size_t)bytes)
+        return 1;
+    *value = 0;
+    for (int i = 0; i < bytes; i++)
+        *value |= (u64)buf[i] << (i * 8);
+    return 0;
+}
+
+static int fbtrace_check_header(FILE *f) {
+    char magic[4];
+    u64 width, height;
+
+    if (fread(magic, 1, 4, f) != 4 || memcmp(magic, "GBFT", 4) ||
+            fbtrace_read_le(f, &width, 2) || fbtrace_read_le(f, &height, 2))
+        return 1;
+    return width != FBTRACE_WIDTH || height != FBTRACE_HEIGHT;
+}
+
+struct fbtrace *fbtrace_open(const char *out_filename,
+        const char *golden_filename) {
+    struct fbtrace *t = calloc(1, sizeof(struct fbtrace));
+    if (!t)
+        return NULL;
+
+    if (out_filename) {
+        t->out = fopen(out_filename, "wb");
+        if (!t->out) {
+            fprintf(stderr, "Couldn't open %s for writing\n", out_filename);
+            return NULL;
+        }
+        fwrite("GBFT", 1, 4, t->out);
+        fbtrace_write_le(t->out, FBTRACE_WIDTH, 2);
+        fbtrace_write_le(t->out, FBTRACE_HEIGHT, 2);
+    }
+
+    if (golden_filename) {
+        t->golden = fopen(golden_filename, "rb");
+        if (!t->golden || fbtrace_check_header(t->golden)) {
+            fprintf(stderr, "Couldn't read trace %s\n", golden_filename);
+            return NULL;
+        }
+    }
+
+    t->frame_hash = hash_buf(t->prev, sizeof(t->prev), 0);
+    return t;
+}
+
+/* Read the next frame of the golden trace into golden_fb. */
+static int fbtrace_golden_frame(struct fbtrace *t, u64 *hash) {
+    u8 map[FBTRACE_MAP_BYTES];
+
+    if (fbtrace_read_le(t->golden, hash, 8) ||
+            fread(map, 1, sizeof(map), t->golden) != sizeof(map))
+        return 1;
+    for (int y = 0; y < FBTRACE_HEIGHT; y++)
+        if (map[y / 8] & (1 << (y % 8)))
+            if (fread(&t->golden_fb[y * FBTRACE_WIDTH], 1, FBTRACE_ROW_BYTES,
+                        t->golden) != FBTRACE_ROW_BYTES)
+                return 1;
+    return 0;
+}
+
+static int fbtrace_compare(struct fbtrace *t, const u16 *pixbuf) {
+    u64 golden_hash;
+
+    if (fbtrace_golden_frame(t, &golden_hash)) {
+        printf("fbtrace: golden trace ends before frame %u\n", t->frame);
+        return 1;
+    }
+    if (golden_hash == t->hash)
+        return 0;
+
+    int first = -1, last = -1;
+    for (int y = 0; y < FBTRACE_HEIGHT; y++)
+        if (memcmp(&pixbuf[y * FBTRACE_WIDTH], &t->golden_fb[y * FBTRACE_WIDTH],
+                    FBTRACE_ROW_BYTES)) {
+            if (first < 0)
+                first = y;
+            last = y;
+        }
+    if (first < 0)
+        printf("fbtrace: frame %u differs from golden trace (hash only)\n",
+                t->frame);
+    else
+        printf("fbtrace: frame %u differs from golden trace in rows %d-%d\n",
+                t->frame, first, last);
+    return 1;
+}
+
+int fbtrace_frame(struct fbtrace *t, const u16 *pixbuf, bool dup) {
+    u8 map[FBTRACE_MAP_BYTES];
+    int changed = 0;
+
+    memset(map, 0, sizeof(map));
+    if (!dup)
+        for (int y = 0; y < FBTRACE_HEIGHT; y++)
+            if (memcmp(&t->prev[y * FBTRACE_WIDTH], &pixbuf[y * FBTRACE_WIDTH],
+                        FBTRACE_ROW_BYTES)) {
+                map[y / 8] |= 1 << (y % 8);
+                changed++;
+            }
+
+    /* Unchanged frames don't need to be hashed again. */
+    if (changed)
+        t->frame_hash = hash_buf(pixbuf, sizeof(t->prev), 0);
+    t->hash = hash_buf(&t->frame_hash, sizeof(t->frame_hash), t->hash);
+
+    if (t->out) {
+        fbtrace_write_le(t->out, t->hash, 8);
+        fwrite(map, 1, sizeof(map), t->out);
+    }
+    for (int y = 0; y < FBTRACE_HEIGHT; y++)
+        if (map[y / 8] & (1 << (y % 8))) {
+            if (t->out)
+                fwrite(&pixbuf[y * FBTRACE_WIDTH], 1, FBTRACE_ROW_BYTES,
+                        t->out);
+            memcpy(&t->prev[y * FBTRACE_WIDTH], &pixbuf[y * FBTRACE_WIDTH],
+                    FBTRACE_ROW_BYTES);
+        }
+
+    int ret = t->golden ? fbtrace_compare(t, pixbuf) : 0;
+    t->frame++;
+    return ret;
+}
+
+void fbtrace_close(struct fbtrace *t) {
+    if (t->out)
+        fclose(t->out);
+    if (t->golden)
+        fclose(t->golden);
+    free(t);
+}
@@ -0,0 +1,26 @@
+#ifndef FBTRACE_H
+#define FBTRACE_H
+
+#include "types.h"
+
+/*
+ * Framebuffer traces for regression testing: for every frame, only the rows
+ * that changed since the previous frame are stored, together with a rolling
+ * hash of all frames so far. A trace can be checked against a golden trace
+ * while running, which reports the first frame that differs.
+ */
+struct fbtrace;
+
+/* Write a trace to out_filename and/or compare against golden_filename
+ * (either can be NULL). Returns NULL on failure. */
+struct fbtrace *fbtrace_open(const char *out_filename,
+        const char *golden_filename);
+
+/* Add a frame (lcd_pixbuf after emu_step_frame). dup can be set when the
+ * frame is known to be identical to the previous one (lcd_frame_dup). Returns
+ * 1 if the frame differs from the golden trace (or that trace ended). */
+int fbtrace_frame(struct fbtrace *t, const u16 *pixbuf, bool dup);
+
+void fbtrace_close(struct fbtrace *t);
+
+#endif
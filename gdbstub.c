@@ -0,0 +1,436 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "gdbstub.h"
+#include "mmu.h"
+#include "breakpoint.h"
+#include "reverse.h"
+
+#define GDB_MAX_PACKET 4096 /* Data, without framing. */
+#define GDB_NUM_REGS 13 /* Of the Z80: af bc de hl sp pc ix iy af' ... ir */
+
+#define GDB_SIGINT  2
+#define GDB_SIGTRAP 5
+
+struct gdb {
+    int fd;
+    bool stopped; /* GDB knows the target is stopped. */
+    bool interrupted; /* By ^C, rather than a breakpoint or step. */
+
+    u8 in[GDB_MAX_PACKET];
+    size_t in_pos, in_len;
+    char packet[GDB_MAX_PACKET + 1];
+    char reply[GDB_MAX_PACKET + 1];
+};
+
+static const char gdb_target_xml[] =
+    "<?xml version=\"1.0\"?>"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+    "<target version=\"1.0\">"
+    "<architecture>z80</architecture>"
+    "<feature name=\"org.gnu.gdb.z80.cpu\">"
+    "<reg name=\"af\" bitsize=\"16\" type=\"int\"/>"
+    "<reg name=\"bc\" bitsize=\"16\" type=\"int\"/>"
+    "<reg name=\"de\" bitsize=\"16\" type=\"data_ptr\"/>"
+    "<reg name=\"hl\" bitsize=\"16\" type=\"data_ptr\"/>"
+    "<reg name=\"sp\" bitsize=\"16\" type=\"data_ptr\"/>"
+    "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>"
+    "<reg name=\"ix\" bitsize=\"16\" type=\"data_ptr\"/>"
+    "<reg name=\"iy\" bitsize=\"16\" type=\"data_ptr\"/>"
+    "<reg name=\"af'\" bitsize=\"16\" type=\"int\"/>"
+    "<reg name=\"bc'\" bitsize=\"16\" type=\"int\"/>"
+    "<reg name=\"de'\" bitsize=\"16\" type=\"int\"/>"
+    "<reg name=\"hl'\" bitsize=\"16\" type=\"int\"/>"
+    "<reg name=\"ir\" bitsize=\"16\" type=\"int\"/>"
+    "</feature>"
+    "</target>";
+
+struct gdb *gdb_open(int port) {
+    struct sockaddr_in addr;
+    int one = 1;
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        return NULL;
+    }
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+            listen(listen_fd, 1)) {
+        perror("Couldn't listen for GDB");
+        close(listen_fd);
+        return NULL;
+    }
+
+    printf("Waiting for GDB to connect on port %d...\n", port);
+    fflush(stdout);
+    int fd = accept(listen_fd, NULL, NULL);
+    close(listen_fd);
+    if (fd < 0) {
+        perror("accept");
+        return NULL;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    printf("GDB connected\n");
+
+    struct gdb *g = calloc(1, sizeof(struct gdb));
+    if (!g)
+        return NULL;
+    g->fd = fd;
+    g->stopped = 1; /* GDB assumes this when connecting. */
+    return g;
+}
+
+/* Next byte from GDB, or -1 if the connection was closed. */
+static int gdb_getc(struct gdb *g) {
+    if (g->in_pos == g->in_len) {
+        ssize_t len = recv(g->fd, g->in, sizeof(g->in), 0);
+        if (len <= 0)
+            return -1;
+        g->in_pos = 0;
+        g->in_len = len;
+    }
+    return g->in[g->in_pos++];
+}
+
+static int gdb_hex(int c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Read a packet into g->packet (acknowledging it). Returns 1 when the
+ * connection was closed. */
+static int gdb_recv(struct gdb *g) {
+    while (1) {
+        int c;
+        while ((c = gdb_getc(g)) != '$')
+            if (c < 0)
+                return 1;
+
+        size_t len = 0;
+        u8 sum = 0;
+        while ((c = gdb_getc(g)) != '#') {
+            if (c < 0)
+                return 1;
+            if (len < GDB_MAX_PACKET)
+                g->packet[len++] = c;
+            sum += c;
+        }
+        g->packet[len] = '\0';
+
+        int hi = gdb_hex(gdb_getc(g)), lo = gdb_hex(gdb_getc(g));
+        if (hi >= 0 && lo >= 0 && (hi << 4 | lo) == sum) {
+            send(g->fd, "+", 1, 0);
+            return 0;
+        }
+        send(g->fd, "-", 1, 0);
+    }
+}
+
+/* Send a packet, until GDB acknowledges it. Returns 1 when the connection was
+ * closed. */
+static int gdb_send(struct gdb *g, const char *data) {
+    static const char hex[] = "0123456789abcdef";
+    size_t len = strlen(data);
+    char frame[GDB_MAX_PACKET + 4];
+    u8 sum = 0;
+
+    frame[0] = '$';
+    for (size_t i = 0; i < len; i++)
+        sum += data[i];
+    memcpy(frame + 1, data, len);
+    frame[len + 1] = '#';
+    frame[len + 2] = hex[sum >> 4];
+    frame[len + 3] = hex[sum & 0xf];
+
+    while (1) {
+        if (send(g->fd, frame, len + 4, 0) < 0)
+            return 1;
+        int c = gdb_getc(g);
+        if (c < 0)
+            return 1;
+        if (c == '+')
+            return 0;
+    }
+}
+
+static u16 *gdb_reg(struct gb_state *s, int reg) {
+    switch (reg) {
+    case 0: return &s->reg16.AF;
+    case 1: return &s->reg16.BC;
+    case 2: return &s->reg16.DE;
+    case 3: return &s->reg16.HL;
+    case 4: return &s->sp;
+    case 5: return &s->pc;
+    default: return NULL; /* Not on the GameBoy, always 0. */
+    }
+}
+
+static void gdb_put_u16(char *buf, u16 val) {
+    sprintf(buf, "%02x%02x", val & 0xff, val >> 8);
+}
+
+static u16 gdb_get_u16(const char *buf) {
+    return (gdb_hex(buf[0]) << 4 | gdb_hex(buf[1])) |
+        (gdb_hex(buf[2]) << 12 | gdb_hex(buf[3]) << 8);
+}
+
+static void gdb_set_reg(struct gb_state *s, int reg, u16 val) {
+    u16 *r = gdb_reg(s, reg);
+    if (r)
+        *r = reg == 0 ? val & 0xfff0 : val; /* Low bits of F are always 0. */
+}
+
+static void gdb_stop_reply(struct gdb *g, struct gb_state *s) {
+    struct breakpoints *bps = s->emu_state->breakpoints;
+
+    if (g->interrupted)
+        sprintf(g->reply, "S%02x", GDB_SIGINT);
+    else if (bps->watch_hit)
+        sprintf(g->reply, "T%02x%s:%04x;", GDB_SIGTRAP,
+                bps->watch_hit == BP_WRITE ? "watch" :
+                bps->watch_hit == BP_READ ? "rwatch" : "awatch",
+                bps->watch_hit_addr);
+    else
+        sprintf(g->reply, "S%02x", GDB_SIGTRAP);
+    g->interrupted = 0;
+    bps->watch_hit = 0;
+}
+
+/* Memory accesses for GDB must not enter the debugger on MMU errors (e.g.,
+ * unusable areas or unknown I/O ports), as that would wait for another packet
+ * before this one is answered. gdb_mem_end returns 1 if there was one. */
+static void gdb_mem_begin(struct gb_state *s) {
+    s->emu_state->dbg_mem_access = 1;
+    s->emu_state->dbg_mem_error = 0;
+}
+
+static bool gdb_mem_end(struct gb_state *s) {
+    s->emu_state->dbg_mem_access = 0;
+    return s->emu_state->dbg_mem_error;
+}
+
+/* Z/z packets: "type,addr,kind". Returns the reply. */
+static const char *gdb_breakpoint(struct gb_state *s, const char *args,
+        bool insert) {
+    static const int kinds[] = { BP_EXEC, BP_EXEC, BP_WRITE, BP_READ,
+        BP_READ | BP_WRITE };
+    unsigned type, addr, len;
+
+    if (sscanf(args, "%x,%x,%x", &type, &addr, &len) != 3 || type > 4)
+        return "E01";
+    if (type < 2)
+        len = 1; /* The kind of (software) breakpoints isn't a length. */
+    if (!len || addr + len > 0x10000)
+        return "E01";
+
+    if (insert)
+        return bp_add(s->emu_state->breakpoints, kinds[type], BP_ANY_BANK,
+                addr, addr + len - 1, NULL) < 0 ? "E02" : "OK";
+    bp_remove(s->emu_state->breakpoints, -1, kinds[type], addr,
+            addr + len - 1);
+    return "OK";
+}
+
+/* Handle a request, putting the reply in g->reply. Returns 1 when execution
+ * should resume. */
+static int gdb_handle(struct gdb *g, struct gb_state *s) {
+    char *p = g->packet;
+    unsigned addr, len;
+
+    g->reply[0] = '\0';
+    switch (*p++) {
+    case '?':
+        gdb_stop_reply(g, s);
+        break;
+
+    case 'g':
+        for (int i = 0; i < GDB_NUM_REGS; i++)
+            gdb_put_u16(g->reply + i * 4, gdb_reg(s, i) ? *gdb_reg(s, i) : 0);
+        break;
+
+    case 'G':
+        if (strlen(p) < GDB_NUM_REGS * 4) {
+            strcpy(g->reply, "E01");
+            break;
+        }
+        for (int i = 0; i < GDB_NUM_REGS; i++)
+            gdb_set_reg(s, i, gdb_get_u16(p + i * 4));
+        strcpy(g->reply, "OK");
+        break;
+
+    case 'p':
+        addr = strtoul(p, NULL, 16);
+        if (addr >= GDB_NUM_REGS)
+            strcpy(g->reply, "E01");
+        else
+            gdb_put_u16(g->reply, gdb_reg(s, addr) ? *gdb_reg(s, addr) : 0);
+        break;
+
+    case 'P':
+        if (sscanf(p, "%x=", &addr) != 1 || addr >= GDB_NUM_REGS ||
+                !strchr(p, '=') || strlen(strchr(p, '=') + 1) < 4) {
+            strcpy(g->reply, "E01");
+            break;
+        }
+        gdb_set_reg(s, addr, gdb_get_u16(strchr(p, '=') + 1));
+        strcpy(g->reply, "OK");
+        break;
+
+    case 'm':
+        if (sscanf(p, "%x,%x", &addr, &len) != 2 ||
+                len > GDB_MAX_PACKET / 2) {
+            strcpy(g->reply, "E01");
+            break;
+        }
+        gdb_mem_begin(s);
+        for (unsigned i = 0; i < len; i++)
+            sprintf(g->reply + i * 2, "%02x", mmu_read(s, addr + i));
+        if (gdb_mem_end(s))
+            strcpy(g->reply, "E03");
+        break;
+
+    case 'M':
+    {
+        char *data = strchr(p, ':');
+        if (sscanf(p, "%x,%x:", &addr, &len) != 2 || !data ||
+                strlen(data + 1) < len * 2) {
+            strcpy(g->reply, "E01");
+            break;
+        }
+        gdb_mem_begin(s);
+        for (unsigned i = 0; i < len; i++)
+            mmu_write(s, addr + i, gdb_hex(data[1 + i * 2]) << 4 |
+                    gdb_hex(data[2 + i * 2]));
+        strcpy(g->reply, gdb_mem_end(s) ? "E03" : "OK");
+        break;
+    }
+
+    case 'c':
+    case 's':
+        if (*p)
+            s->pc = strtoul(p, NULL, 16);
+        s->emu_state->dbg_break_next = g->packet[0] == 's';
+        return 1;
+
+    case 'b': /* bs/bc: reverse step/continue, which stop immediately. */
+        if (s->emu_state->reverse && (*p == 's' || *p == 'c')) {
+            if (*p == 's')
+                reverse_step(s->emu_state->reverse, s);
+            else
+                reverse_continue(s->emu_state->reverse, s);
+            gdb_stop_reply(g, s);
+        }
+        break;
+
+    case 'Z':
+    case 'z':
+        strcpy(g->reply, gdb_breakpoint(s, p, g->packet[0] == 'Z'));
+        break;
+
+    case 'H':
+        strcpy(g->reply, "OK");
+        break;
+
+    case 'q':
+        if (!strncmp(p, "Supported", 9))
+            sprintf(g->reply, "PacketSize=%x;qXfer:features:read+%s",
+                    GDB_MAX_PACKET, s->emu_state->reverse ?
+                    ";ReverseStep+;ReverseContinue+" : "");
+        else if (!strcmp(p, "Attached"))
+            strcpy(g->reply, "1");
+        else if (sscanf(p, "Xfer:features:read:target.xml:%x,%x", &addr,
+                    &len) == 2) {
+            size_t size = sizeof(gdb_target_xml) - 1;
+            if (len > GDB_MAX_PACKET - 1)
+                len = GDB_MAX_PACKET - 1;
+            if (addr >= size)
+                strcpy(g->reply, "l");
+            else {
+                g->reply[0] = addr + len >= size ? 'l' : 'm';
+                snprintf(g->reply + 1, len + 1, "%s", gdb_target_xml + addr);
+            }
+        }
+        break;
+    }
+    return 0;
+}
+
+static void gdb_close(struct gdb *g, struct gb_state *s) {
+    printf("GDB disconnected\n");
+    close(g->fd);
+    free(g);
+    s->emu_state->gdb = NULL;
+    s->emu_state->dbg_break_next = 0;
+}
+
+int gdb_run(struct gdb *g, struct gb_state *s) {
+    /* Tell GDB why we stopped after it resumed execution. */
+    if (!g->stopped) {
+        g->stopped = 1;
+        gdb_stop_reply(g, s);
+        if (gdb_send(g, g->reply)) {
+            gdb_close(g, s);
+            return 0;
+        }
+    }
+
+    while (1) {
+        if (gdb_recv(g)) {
+            gdb_close(g, s);
+            return 0;
+        }
+
+        switch (g->packet[0]) {
+        case 'k': /* Kill */
+            gdb_close(g, s);
+            s->emu_state->quit = 1;
+            return 1;
+        case 'D': /* Detach */
+            gdb_send(g, "OK");
+            gdb_close(g, s);
+            return 0;
+        }
+
+        bool resume = gdb_handle(g, s);
+        if (resume) {
+            g->stopped = 0;
+            return 0;
+        }
+        if (gdb_send(g, g->reply)) {
+            gdb_close(g, s);
+            return 0;
+        }
+    }
+}
+
+void gdb_poll(struct gdb *g, struct gb_state *s) {
+    u8 c;
+    ssize_t len;
+
+    while ((len = recv(g->fd, &c, 1, MSG_DONTWAIT)) == 1) {
+        if (c == 0x03) {
+            g->interrupted = 1;
+            s->emu_state->dbg_break_next = 1;
+        }
+    }
+    if (len == 0)
+        gdb_close(g, s);
+}
@@ -0,0 +1,27 @@
+#ifndef GDBSTUB_H
+#define GDBSTUB_H
+
+#include "types.h"
+
+/*
+ * GDB remote serial protocol server, used instead of the debugger prompt when
+ * connected. GDB sees the CPU as a Z80 (`set architecture z80`, which is
+ * selected automatically), with the GameBoy's registers and the currently
+ * mapped 64K of memory. The connection is only checked for interrupts (^C)
+ * once per frame; the emulator runs at full speed until a breakpoint.
+ * Only works in debug builds, as it relies on the debugger hooks.
+ */
+struct gdb;
+
+/* Listen on localhost:port and wait for GDB to connect. Returns NULL on
+ * failure. */
+struct gdb *gdb_open(int port);
+
+/* Called by dbg_run_debugger: report the stop to GDB and handle its requests
+ * until it resumes execution. Returns 1 to quit. */
+int gdb_run(struct gdb *g, struct gb_state *s);
+
+/* Check for an interrupt request from GDB, call once per frame. */
+void gdb_poll(struct gdb *g, struct gb_state *s);
+
+#endif
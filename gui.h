@@ -3,10 +3,19 @@
 
 #include "player_input.h"
 
-int gui_audio_init(int sample_rate, int channels, size_t sndbuf_size,
-        uint8_t *sndbuf);
+int gui_audio_init(int sample_rate, int channels);
+void gui_audio_queue(int16_t *samples, int num_samples);
+/* Number of times the audio device ran out of samples (underruns), and the
+ * number of times samples were dropped because the buffer was full. */
+void gui_audio_stats(unsigned *underruns, unsigned *overruns);
+/* Number of samples queued but not yet handed to the audio device. */
+int gui_audio_buffered(void);
+
+/* Sleep (roughly) the given number of seconds. */
+void gui_sleep(double seconds);
 
 int gui_lcd_init(int width, int height, int zoom, char *wintitle);
+/* pixbuf can be NULL if the frame did not change, this shows the last one. */
 void gui_lcd_render_frame(char use_colors, uint16_t *pixbuf);
 
 
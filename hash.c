@@ -0,0 +1,74 @@
+/*
+ * 64-bit hash in the style of xxHash64: the input is consumed 32 bytes at a
+ * time by four independent accumulators (lanes), so the multiplications of
+ * the lanes can execute in parallel, and the lanes are mixed together at the
+ * end. Used for comparing framebuffers and emulator state, so it should be
+ * fast on a few KB of data, but it is not meant to resist attacks.
+ */
+
+#include <string.h>
+
+#include "hash.h"
+
+static const u64 HASH_P1 = 0x9e3779b185ebca87ULL;
+static const u64 HASH_P2 = 0xc2b2ae3d27d4eb4fULL;
+static const u64 HASH_P3 = 0x165667b19e3779f9ULL;
+static const u64 HASH_P4 = 0x85ebca77c2b2ae63ULL;
+static const u64 HASH_P5 = 0x27d4eb2f165667c5ULL;
+
+static u64 hash_rotl(u64 x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static u64 hash_read64(const u8 *p) {
+    u64 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static u64 hash_round(u64 acc, u64 input) {
+    acc += input * HASH_P2;
+    acc = hash_rotl(acc, 31);
+    return acc * HASH_P1;
+}
+
+static u64 hash_merge(u64 h, u64 lane) {
+    h ^= hash_round(0, lane);
+    return h * HASH_P1 + HASH_P4;
+}
+
+u64 hash_buf(const void *data, size_t len, u64 seed) {
+    const u8 *p = data;
+    const u8 *end = p + len;
+    u64 h;
+
+    if (len >= 32) {
+        u64 lane[4] = { seed + HASH_P1 + HASH_P2, seed + HASH_P2, seed,
+                        seed - HASH_P1 };
+        for (; p + 32 <= end; p += 32)
+            for (int i = 0; i < 4; i++)
+                lane[i] = hash_round(lane[i], hash_read64(p + i * 8));
+
+        h = hash_rotl(lane[0], 1) + hash_rotl(lane[1], 7) +
+            hash_rotl(lane[2], 12) + hash_rotl(lane[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = hash_merge(h, lane[i]);
+    } else {
+        h = seed + HASH_P5;
+    }
+
+    h += len;
+    for (; p + 8 <= end; p += 8)
+        h = hash_rotl(h ^ hash_round(0, hash_read64(p)), 27) * HASH_P1 +
+            HASH_P4;
+    for (; p < end; p++)
+        h = hash_rotl(h ^ (*p * HASH_P5), 11) * HASH_P1;
+
+    /* Final avalanche, so every input bit affects every output bit. */
+    h ^= h >> 33;
+    h *= HASH_P2;
+    h ^= h >> 29;
+    h *= HASH_P3;
+    h ^= h >> 32;
+    return h;
+}
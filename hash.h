@@ -0,0 +1,12 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+
+#include "types.h"
+
+/* Fast (non-cryptographic) 64-bit hash of a buffer. Chaining hashes by
+ * passing the previous one as seed gives a hash of the whole sequence. */
+u64 hash_buf(const void *data, size_t len, u64 seed);
+
+#endif
@@ -19,8 +19,9 @@ static const int GB_LCD_FRAME_CLKS  = 70224; /* Total cycles per frame */
 static const int GB_DIV_FREQ = 16384;  /* Hz */
 static const int GB_TIMA_FREQS[] = { 4096, 262144, 65536, 16384 };  /* Hz */
 
-static const double GB_SND_DUTY_PERC[] = { .125, .25, .50, .75 };
-static const int GB_SND_ENVSTEP_CYC = GB_FREQ/64; /* n*(1/64)th seconds */
+static const int GB_SND_DUTY_WAVES[] = { 0x01, 0x81, 0x87, 0x7e }; /* 1/8ths */
+static const int GB_SND_NOISE_DIVISORS[] = { 8, 16, 32, 48, 64, 80, 96, 112 };
+static const int GB_SND_FRAME_SEQ_CLKS = 8192; /* 512 Hz */
 
 static const unsigned ROMHDR_TITLE      = 0x134;
 static const unsigned ROMHDR_CGBFLAG    = 0x143;
@@ -1,21 +1,471 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
 #include "lcd.h"
 #include "hwdefs.h"
+#include "perf.h"
 
-static void lcd_render_current_line(struct gb_state *gb_state);
+#define LCD_LOG_SIZE 16384 /* Entries, flushed early when full. */
+#define LCD_RING_SIZE 16384 /* Entries, must be a power of two. */
+
+/* Messages to the render thread, besides the enum lcd_write_kind writes. */
+enum {
+    LCD_MSG_LINE = LCD_WRITE_OBPD + 1, /* Render line `offset`. */
+    LCD_MSG_FRAME, /* Frame done, publish it. */
+    LCD_MSG_QUIT,
+};
+
+/*
+ * Per-line lists of the (max 10) sprites on each line, ordered from highest to
+ * lowest priority. OAM rarely changes more than once per frame, so these are
+ * only rebuilt when OAM or the sprite size changes instead of on every line.
+ */
+struct lcd_obj_cache {
+    bool dirty;
+    u8 obj_height;
+    u8 num[144];
+    u8 idx[144][10];
+};
+
+/*
+ * Everything that determines what a line looks like. For immediate rendering
+ * this is taken directly from struct gb_state, for deferred rendering from the
+ * shadow copy in struct emu_lcd_state.
+ */
+struct lcd_view {
+    bool use_col;
+    u8 LCDC, SCX, SCY, WX, WY, BGP, OBP0, OBP1;
+    u8 *BGPD;
+    u8 *OBPD;
+    u8 *OAM;
+    u8 *VRAM;
+    struct lcd_obj_cache *objs;
+};
+
+/* Write to VRAM/OAM/registers, done before H-Blank number `line` of frame. */
+struct lcd_log_entry {
+    u8 line;
+    u8 kind; /* enum lcd_write_kind */
+    u16 offset;
+    u8 value;
+};
+
+struct emu_lcd_state {
+    /* Deferred rendering: the state as it was at the last flush, and the
+     * writes done since then. Lines are rendered by replaying the log up to
+     * the point each line was reached. */
+    struct lcd_view shadow;
+    u8 shadow_BGPD[0x40];
+    u8 shadow_OBPD[0x40];
+    u8 shadow_OAM[0xa0];
+    u8 *shadow_VRAM;
+    struct lcd_obj_cache shadow_objs;
+
+    /* Sprite lists for immediate rendering from struct gb_state. */
+    struct lcd_obj_cache live_objs;
+
+    /* Skipping unchanged lines: write_seq counts writes that changed anything
+     * rendering depends on, line_seq holds its value when each line was last
+     * rendered. A line whose inputs did not change since then would come out
+     * the same, so it is not rendered again. */
+    unsigned write_seq;
+    unsigned line_seq[144];
+    int frame_lines; /* Lines rendered since the last V-Blank. */
+    bool prev_frame_dup;
+
+    struct lcd_log_entry *log;
+    int log_len;
+
+    u8 lines[144]; /* LY of each H-Blank reached since last flush. */
+    int num_lines;
+
+    /* Threaded rendering: the same shadow copy is owned by the render thread,
+     * which receives the writes and the lines to render through a
+     * single-producer single-consumer ring. The producer only publishes its
+     * head at line/frame boundaries (or when the ring is full). */
+    pthread_t thread;
+    bool thread_running;
+    struct lcd_log_entry *ring;
+    atomic_size_t ring_head;
+    atomic_size_t ring_tail;
+    size_t ring_wpos; /* Emulation thread only. */
+    size_t ring_tail_cached; /* Emulation thread only. */
+
+    u16 *work_pixbuf; /* Render thread only. */
+    struct perf *perf;
+    u16 *frame_pixbufs[2]; /* Frame n is published in frame_pixbufs[n & 1]. */
+    atomic_uint frames_done;
+    unsigned frames_sent;
+
+    u16 *pixbuf; /* From lcd_init, lcd_pixbuf may point to frame_pixbufs. */
+};
+
+static void lcd_render_line(struct lcd_view *v, int y, u16 *pixbuf);
+
+/* Copy all rendering-related state into the shadow copy. */
+static void lcd_shadow_sync(struct gb_state *s) {
+    struct emu_lcd_state *ls = s->emu_lcd_state;
+    struct lcd_view *v = &ls->shadow;
+
+    v->use_col = s->gb_type == GB_TYPE_CGB;
+    v->LCDC = s->io_lcd_LCDC;
+    v->SCX = s->io_lcd_SCX;
+    v->SCY = s->io_lcd_SCY;
+    v->WX = s->io_lcd_WX;
+    v->WY = s->io_lcd_WY;
+    v->BGP = s->io_lcd_BGP;
+    v->OBP0 = s->io_lcd_OBP0;
+    v->OBP1 = s->io_lcd_OBP1;
+    memcpy(ls->shadow_BGPD, s->io_lcd_BGPD, sizeof(ls->shadow_BGPD));
+    memcpy(ls->shadow_OBPD, s->io_lcd_OBPD, sizeof(ls->shadow_OBPD));
+    memcpy(ls->shadow_OAM, s->mem_OAM, sizeof(ls->shadow_OAM));
+    memcpy(ls->shadow_VRAM, s->mem_VRAM,
+            VRAM_BANKSIZE * s->mem_num_banks_vram);
+}
+
+static void lcd_shadow_apply(struct emu_lcd_state *ls,
+        struct lcd_log_entry *e) {
+    struct lcd_view *v = &ls->shadow;
+
+    switch (e->kind) {
+    case LCD_WRITE_VRAM: ls->shadow_VRAM[e->offset] = e->value; break;
+    case LCD_WRITE_OAM:
+        ls->shadow_OAM[e->offset] = e->value;
+        ls->shadow_objs.dirty = 1;
+        break;
+    case LCD_WRITE_BGPD: ls->shadow_BGPD[e->offset] = e->value; break;
+    case LCD_WRITE_OBPD: ls->shadow_OBPD[e->offset] = e->value; break;
+    case LCD_WRITE_REG:
+        switch (e->offset) {
+        case 0xff40: v->LCDC = e->value; break;
+        case 0xff42: v->SCY = e->value; break;
+        case 0xff43: v->SCX = e->value; break;
+        case 0xff47: v->BGP = e->value; break;
+        case 0xff48: v->OBP0 = e->value; break;
+        case 0xff49: v->OBP1 = e->value; break;
+        case 0xff4a: v->WY = e->value; break;
+        case 0xff4b: v->WX = e->value; break;
+        }
+        break;
+    }
+}
+
+/* Wait a little while for the other thread to make progress. */
+static void lcd_backoff(int *spins) {
+    if ((*spins)++ < 64) {
+        sched_yield();
+    } else {
+        struct timespec ts = { 0, 100000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void lcd_ring_publish(struct emu_lcd_state *ls) {
+    atomic_store_explicit(&ls->ring_head, ls->ring_wpos, memory_order_release);
+}
+
+static void lcd_ring_push(struct emu_lcd_state *ls, u8 kind, u16 offset,
+        u8 value) {
+    if (ls->ring_wpos - ls->ring_tail_cached == LCD_RING_SIZE) {
+        int spins = 0;
+        lcd_ring_publish(ls);
+        while (ls->ring_wpos - (ls->ring_tail_cached = atomic_load_explicit(
+                        &ls->ring_tail, memory_order_acquire)) ==
+                LCD_RING_SIZE)
+            lcd_backoff(&spins);
+    }
+
+    struct lcd_log_entry *e = &ls->ring[ls->ring_wpos & (LCD_RING_SIZE - 1)];
+    e->kind = kind;
+    e->offset = offset;
+    e->value = value;
+    ls->ring_wpos++;
+}
+
+static void *lcd_render_thread(void *arg) {
+    struct emu_lcd_state *ls = arg;
+    size_t tail = 0;
+    int spins = 0;
+
+    while (1) {
+        size_t head = atomic_load_explicit(&ls->ring_head,
+                memory_order_acquire);
+        if (tail == head) {
+            lcd_backoff(&spins);
+            continue;
+        }
+        spins = 0;
+
+        for (; tail != head; tail++) {
+            struct lcd_log_entry *e = &ls->ring[tail & (LCD_RING_SIZE - 1)];
+            switch (e->kind) {
+            case LCD_MSG_LINE:
+            {
+                struct perf_timer timer;
+                perf_begin(ls->perf, &timer);
+                lcd_render_line(&ls->shadow, e->offset, ls->work_pixbuf);
+                perf_end(ls->perf, PERF_LCD, &timer);
+                break;
+            }
+            case LCD_MSG_FRAME:
+            {
+                unsigned n = atomic_load_explicit(&ls->frames_done,
+                        memory_order_relaxed);
+                memcpy(ls->frame_pixbufs[n & 1], ls->work_pixbuf,
+                        GB_LCD_WIDTH * GB_LCD_HEIGHT * sizeof(u16));
+                atomic_store_explicit(&ls->frames_done, n + 1,
+                        memory_order_release);
+                break;
+            }
+            case LCD_MSG_QUIT:
+                return NULL;
+            default:
+                lcd_shadow_apply(ls, e);
+            }
+        }
+        atomic_store_explicit(&ls->ring_tail, tail, memory_order_release);
+    }
+}
+
+/* End of frame for the threaded renderers: point lcd_pixbuf to the frame that
+ * should be shown now, waiting for the render thread if needed. */
+static void lcd_threaded_frame(struct gb_state *s) {
+    struct emu_lcd_state *ls = s->emu_lcd_state;
+    unsigned frame;
+    int spins = 0;
+
+    lcd_ring_push(ls, LCD_MSG_FRAME, 0, 0);
+    lcd_ring_publish(ls);
+    ls->frames_sent++;
+
+    if (s->emu_state->lcd_render_mode == LCD_RENDER_THREADED)
+        frame = ls->frames_sent;
+    else if (ls->frames_sent > 1)
+        frame = ls->frames_sent - 1;
+    else
+        return;
+
+    while (atomic_load_explicit(&ls->frames_done, memory_order_acquire) < frame)
+        lcd_backoff(&spins);
+
+    s->emu_state->lcd_pixbuf = ls->frame_pixbufs[(frame - 1) & 1];
+}
+
+/* Render all lines reached since the last flush by replaying the log. */
+static void lcd_deferred_flush(struct gb_state *s) {
+    struct emu_lcd_state *ls = s->emu_lcd_state;
+    int e = 0;
+
+    for (int i = 0; i < ls->num_lines; i++) {
+        while (e < ls->log_len && ls->log[e].line <= i)
+            lcd_shadow_apply(ls, &ls->log[e++]);
+        lcd_render_line(&ls->shadow, ls->lines[i], s->emu_state->lcd_pixbuf);
+    }
+    while (e < ls->log_len)
+        lcd_shadow_apply(ls, &ls->log[e++]);
+
+    ls->log_len = 0;
+    ls->num_lines = 0;
+}
+
+/* The value currently in gb_state for a write of the given kind/offset. */
+static u8 lcd_current_value(struct gb_state *s, enum lcd_write_kind kind,
+        u16 offset) {
+    switch (kind) {
+    case LCD_WRITE_VRAM: return s->mem_VRAM[offset];
+    case LCD_WRITE_OAM:  return s->mem_OAM[offset];
+    case LCD_WRITE_BGPD: return s->io_lcd_BGPD[offset];
+    case LCD_WRITE_OBPD: return s->io_lcd_OBPD[offset];
+    case LCD_WRITE_REG:
+        switch (offset) {
+        case 0xff40: return s->io_lcd_LCDC;
+        case 0xff42: return s->io_lcd_SCY;
+        case 0xff43: return s->io_lcd_SCX;
+        case 0xff47: return s->io_lcd_BGP;
+        case 0xff48: return s->io_lcd_OBP0;
+        case 0xff49: return s->io_lcd_OBP1;
+        case 0xff4a: return s->io_lcd_WY;
+        case 0xff4b: return s->io_lcd_WX;
+        }
+    }
+    return 0;
+}
+
+void lcd_notify_write(struct gb_state *s, enum lcd_write_kind kind,
+        u16 offset, u8 value) {
+    struct emu_lcd_state *ls = s->emu_lcd_state;
+
+    /* Rewriting the same value (e.g., an OAM DMA of unchanged sprites every
+     * frame) changes nothing on screen. */
+    if (lcd_current_value(s, kind, offset) == value)
+        return;
+    ls->write_seq++;
+
+    if (s->emu_state->lcd_render_mode == LCD_RENDER_IMMEDIATE) {
+        if (kind == LCD_WRITE_OAM)
+            ls->live_objs.dirty = 1;
+        return;
+    }
+
+    if (s->emu_state->lcd_render_mode != LCD_RENDER_DEFERRED) {
+        lcd_ring_push(ls, kind, offset, value);
+        return;
+    }
+
+    if (ls->log_len == LCD_LOG_SIZE)
+        lcd_deferred_flush(s);
+
+    struct lcd_log_entry *e = &ls->log[ls->log_len++];
+    e->line = ls->num_lines;
+    e->kind = kind;
+    e->offset = offset;
+    e->value = value;
+}
 
 int lcd_init(struct gb_state *s) {
     s->emu_state->lcd_pixbuf =
-        malloc(GB_LCD_WIDTH * GB_LCD_HEIGHT * sizeof(u16));
+        calloc(GB_LCD_WIDTH * GB_LCD_HEIGHT, sizeof(u16));
     if (!s->emu_state->lcd_pixbuf)
         return 1;
     memset(s->emu_state->lcd_pixbuf, 0,
             GB_LCD_WIDTH * GB_LCD_HEIGHT * sizeof(u16));
+
+    struct emu_lcd_state *ls = calloc(1, sizeof(struct emu_lcd_state));
+    if (!ls)
+        return 1;
+    s->emu_lcd_state = ls;
+    ls->pixbuf = s->emu_state->lcd_pixbuf;
+
+    ls->shadow.BGPD = ls->shadow_BGPD;
+    ls->shadow.OBPD = ls->shadow_OBPD;
+    ls->shadow.OAM = ls->shadow_OAM;
+    ls->shadow_VRAM = malloc(VRAM_BANKSIZE * s->mem_num_banks_vram);
+    ls->shadow.VRAM = ls->shadow_VRAM;
+    ls->shadow.objs = &ls->shadow_objs;
+    ls->shadow_objs.dirty = 1;
+    ls->live_objs.dirty = 1;
+    ls->write_seq = 1; /* No line rendered yet. */
+    ls->log = malloc(LCD_LOG_SIZE * sizeof(struct lcd_log_entry));
+    if (!ls->shadow_VRAM || !ls->log)
+        return 1;
+    lcd_shadow_sync(s);
+
+    if (s->emu_state->lcd_render_mode == LCD_RENDER_THREADED ||
+            s->emu_state->lcd_render_mode == LCD_RENDER_PIPELINED) {
+        size_t pixbuf_size = GB_LCD_WIDTH * GB_LCD_HEIGHT * sizeof(u16);
+        ls->ring = malloc(LCD_RING_SIZE * sizeof(struct lcd_log_entry));
+        ls->work_pixbuf = calloc(1, pixbuf_size);
+        ls->frame_pixbufs[0] = calloc(1, pixbuf_size);
+        ls->frame_pixbufs[1] = calloc(1, pixbuf_size);
+        if (!ls->ring || !ls->work_pixbuf || !ls->frame_pixbufs[0] ||
+                !ls->frame_pixbufs[1])
+            return 1;
+        ls->perf = s->emu_state->perf;
+        if (pthread_create(&ls->thread, NULL, lcd_render_thread, ls))
+            return 1;
+        ls->thread_running = 1;
+    }
+
     return 0;
 }
 
+void lcd_free(struct gb_state *s) {
+    struct emu_lcd_state *ls = s->emu_lcd_state;
+
+    if (!ls)
+        return;
+    if (ls->thread_running) {
+        lcd_ring_push(ls, LCD_MSG_QUIT, 0, 0);
+        lcd_ring_publish(ls);
+        pthread_join(ls->thread, NULL);
+    }
+
+    free(ls->pixbuf);
+    free(ls->shadow_VRAM);
+    free(ls->log);
+    free(ls->ring);
+    free(ls->work_pixbuf);
+    free(ls->frame_pixbufs[0]);
+    free(ls->frame_pixbufs[1]);
+    free(ls);
+    s->emu_lcd_state = NULL;
+    s->emu_state->lcd_pixbuf = NULL;
+}
+
+void lcd_resync(struct gb_state *s) {
+    struct emu_lcd_state *ls = s->emu_lcd_state;
+    int spins = 0;
+
+    if (s->emu_state->lcd_render_mode == LCD_RENDER_DEFERRED)
+        lcd_deferred_flush(s);
+    else if (s->emu_state->lcd_render_mode != LCD_RENDER_IMMEDIATE) {
+        /* The render thread owns the shadow copy until it's idle. */
+        lcd_ring_publish(ls);
+        while (atomic_load_explicit(&ls->ring_tail, memory_order_acquire) !=
+                ls->ring_wpos)
+            lcd_backoff(&spins);
+    }
+
+    lcd_shadow_sync(s);
+    ls->shadow_objs.dirty = 1;
+    ls->live_objs.dirty = 1;
+    ls->write_seq++;
+}
+
+/* Hand the current line (LY) to the renderer. */
+static void lcd_render_current_line(struct gb_state *s) {
+    struct emu_lcd_state *ls = s->emu_lcd_state;
+    int y = s->io_lcd_LY;
+
+    if (y >= GB_LCD_HEIGHT) /* VBlank */
+        return;
+
+    /* Nothing is shown while the LCD is off, keep the last frame around. */
+    if (!(s->io_lcd_LCDC & (1<<7)))
+        return;
+
+    if (ls->line_seq[y] == ls->write_seq)
+        return;
+    ls->line_seq[y] = ls->write_seq;
+    ls->frame_lines++;
+
+    if (s->emu_state->lcd_render_mode == LCD_RENDER_DEFERRED) {
+        if (ls->num_lines == GB_LCD_HEIGHT) /* Only when LY was reset. */
+            lcd_deferred_flush(s);
+        ls->lines[ls->num_lines++] = y;
+        return;
+    }
+
+    if (s->emu_state->lcd_render_mode != LCD_RENDER_IMMEDIATE) {
+        lcd_ring_push(ls, LCD_MSG_LINE, y, 0);
+        lcd_ring_publish(ls);
+        return;
+    }
+
+    struct lcd_view v = {
+        .use_col = s->gb_type == GB_TYPE_CGB,
+        .LCDC = s->io_lcd_LCDC,
+        .SCX = s->io_lcd_SCX,
+        .SCY = s->io_lcd_SCY,
+        .WX = s->io_lcd_WX,
+        .WY = s->io_lcd_WY,
+        .BGP = s->io_lcd_BGP,
+        .OBP0 = s->io_lcd_OBP0,
+        .OBP1 = s->io_lcd_OBP1,
+        .BGPD = s->io_lcd_BGPD,
+        .OBPD = s->io_lcd_OBPD,
+        .OAM = s->mem_OAM,
+        .VRAM = s->mem_VRAM,
+        .objs = &ls->live_objs,
+    };
+    lcd_render_line(&v, y, s->emu_state->lcd_pixbuf);
+}
+
 void lcd_step(struct gb_state *s) {
     /* The LCD goes through several states.
      * 0 = H-Blank, 1 = V-Blank, 2 = reading OAM, 3 = line render
@@ -79,8 +529,33 @@ void lcd_step(struct gb_state *s) {
             s->interrupts_request |= 1 << 1;
     }
 
-    if (s->emu_state->lcd_entered_hblank)
+    struct perf_timer timer;
+    if (s->emu_state->lcd_entered_hblank && !s->emu_state->lcd_render_skip) {
+        perf_begin(s->emu_state->perf, &timer);
         lcd_render_current_line(s);
+        perf_end(s->emu_state->perf, PERF_LCD, &timer);
+    }
+
+    if (s->emu_state->lcd_entered_vblank) {
+        struct emu_lcd_state *ls = s->emu_lcd_state;
+        bool dup = ls->frame_lines == 0;
+        ls->frame_lines = 0;
+
+        /* The pipelined renderer shows the previous frame. */
+        if (s->emu_state->lcd_render_mode == LCD_RENDER_PIPELINED) {
+            s->emu_state->lcd_frame_dup = ls->prev_frame_dup;
+            ls->prev_frame_dup = dup;
+        } else {
+            s->emu_state->lcd_frame_dup = dup;
+        }
+
+        perf_begin(s->emu_state->perf, &timer);
+        if (s->emu_state->lcd_render_mode == LCD_RENDER_DEFERRED)
+            lcd_deferred_flush(s);
+        else if (s->emu_state->lcd_render_mode != LCD_RENDER_IMMEDIATE)
+            lcd_threaded_frame(s);
+        perf_end(s->emu_state->perf, PERF_LCD, &timer);
+    }
 }
 
 
@@ -100,7 +575,35 @@ u8 palette_get_gray(u8 palette, u8 colidx) {
     return (palette >> (colidx << 1)) & 0x3;
 }
 
-static void lcd_render_current_line(struct gb_state *gb_state) {
+/*
+ * Rebuild the per-line sprite lists. Hardware picks the first 10 sprites (in
+ * OAM order) on a line. When they overlap, on DMG the one with the smallest x
+ * coordinate wins (ties go to the lowest OAM index), on CGB only the OAM index
+ * counts.
+ */
+static void lcd_obj_cache_build(struct lcd_view *v, u8 obj_height) {
+    struct lcd_obj_cache *c = v->objs;
+    struct OAMentry *OAM = (struct OAMentry*)&v->OAM[0];
+
+    memset(c->num, 0, sizeof(c->num));
+    for (int i = 0; i < 40; i++) {
+        int top = OAM[i].y - 16;
+        int y = top < 0 ? 0 : top;
+        for (; y < top + obj_height && y < GB_LCD_HEIGHT; y++) {
+            if (c->num[y] == 10)
+                continue;
+            int n = c->num[y]++;
+            if (!v->use_col)
+                for (; n > 0 && OAM[c->idx[y][n - 1]].x > OAM[i].x; n--)
+                    c->idx[y][n] = c->idx[y][n - 1];
+            c->idx[y][n] = i;
+        }
+    }
+    c->obj_height = obj_height;
+    c->dirty = 0;
+}
+
+static void lcd_render_line(struct lcd_view *v, int y, u16 *pixbuf) {
     /*
      * Tile Data @ 8000-8FFF or 8800-97FF defines the pixels per Tile, which can
      * be used for the BG, window or sprite/object. 192 tiles max, 8x8px, 4
@@ -122,21 +625,15 @@ static void lcd_render_current_line(struct gb_state *gb_state) {
      *
      */
 
-    int y = gb_state->io_lcd_LY;
-    u16 *pixbuf = gb_state->emu_state->lcd_pixbuf;
-
-    if (y >= GB_LCD_HEIGHT) /* VBlank */
-        return;
+    u8 use_col = v->use_col;
 
-    u8 use_col = gb_state->gb_type == GB_TYPE_CGB;
-
-    u8 winmap_high       = (gb_state->io_lcd_LCDC & (1<<6)) ? 1 : 0;
-    u8 win_enable        = (gb_state->io_lcd_LCDC & (1<<5)) ? 1 : 0;
-    u8 bgwin_tilemap_low = (gb_state->io_lcd_LCDC & (1<<4)) ? 1 : 0;
-    u8 bgmap_high        = (gb_state->io_lcd_LCDC & (1<<3)) ? 1 : 0;
-    u8 obj_8x16          = (gb_state->io_lcd_LCDC & (1<<2)) ? 1 : 0;
-    u8 obj_enable        = (gb_state->io_lcd_LCDC & (1<<1)) ? 1 : 0;
-    u8 bg_enable         = (gb_state->io_lcd_LCDC & (1<<0)) ? 1 : 0;
+    u8 winmap_high       = (v->LCDC & (1<<6)) ? 1 : 0;
+    u8 win_enable        = (v->LCDC & (1<<5)) ? 1 : 0;
+    u8 bgwin_tilemap_low = (v->LCDC & (1<<4)) ? 1 : 0;
+    u8 bgmap_high        = (v->LCDC & (1<<3)) ? 1 : 0;
+    u8 obj_8x16          = (v->LCDC & (1<<2)) ? 1 : 0;
+    u8 obj_enable        = (v->LCDC & (1<<1)) ? 1 : 0;
+    u8 bg_enable         = (v->LCDC & (1<<0)) ? 1 : 0;
     u8 bgwin_tilemap_unsigned = bgwin_tilemap_low;
 
     if (use_col)
@@ -148,34 +645,28 @@ static void lcd_render_current_line(struct gb_state *gb_state) {
     u16 obj_tiledata_addr = 0x8000;
     u16 vram_addr = 0x8000;
 
-    u8 *bgwin_tiledata = &gb_state->mem_VRAM[bgwin_tilemap_addr - vram_addr];
-    u8 *obj_tiledata = &gb_state->mem_VRAM[obj_tiledata_addr - vram_addr];
-    u8 *bgmap = &gb_state->mem_VRAM[bgmap_addr - vram_addr];
-    u8 *winmap = &gb_state->mem_VRAM[winmap_addr - vram_addr];
+    u8 *bgwin_tiledata = &v->VRAM[bgwin_tilemap_addr - vram_addr];
+    u8 *obj_tiledata = &v->VRAM[obj_tiledata_addr - vram_addr];
+    u8 *bgmap = &v->VRAM[bgmap_addr - vram_addr];
+    u8 *winmap = &v->VRAM[winmap_addr - vram_addr];
 
-    u8 bg_scroll_x = gb_state->io_lcd_SCX;
-    u8 bg_scroll_y = gb_state->io_lcd_SCY;
-    u8 win_pos_x = gb_state->io_lcd_WX;
-    u8 win_pos_y = gb_state->io_lcd_WY;
+    u8 bg_scroll_x = v->SCX;
+    u8 bg_scroll_y = v->SCY;
+    u8 win_pos_x = v->WX;
+    u8 win_pos_y = v->WY;
 
-    u8 bgwin_palette = gb_state->io_lcd_BGP;
-    u8 obj_palette1 = gb_state->io_lcd_OBP0;
-    u8 obj_palette2 = gb_state->io_lcd_OBP1;
+    u8 bgwin_palette = v->BGP;
+    u8 obj_palette1 = v->OBP0;
+    u8 obj_palette2 = v->OBP1;
 
     u8 obj_tile_height = obj_8x16 ? 16 : 8;
 
-    /* OAM scan - gather (max 10) objects on this line in cache */
-    /* TODO: sort the objs so those with smaller x coord have higher prio */
-    struct OAMentry *OAM = (struct OAMentry*)&gb_state->mem_OAM[0];
-    struct OAMentry objs[10];
-    int num_objs = 0;
-    if (obj_enable)
-        for (int i = 0; i < 40; i++) {
-            if (y >= OAM[i].y - 16 && y < OAM[i].y - 16 + obj_tile_height)
-                objs[num_objs++] = OAM[i];
-            if (num_objs == 10)
-                break;
-        }
+    /* OAM scan - the sprites on this line, highest priority first. */
+    struct OAMentry *OAM = (struct OAMentry*)&v->OAM[0];
+    if (v->objs->dirty || v->objs->obj_height != obj_tile_height)
+        lcd_obj_cache_build(v, obj_tile_height);
+    int num_objs = obj_enable ? v->objs->num[y] : 0;
+    u8 *objs = v->objs->idx[y];
 
 
     /* Draw all background pixels of this line. */
@@ -218,7 +709,7 @@ static void lcd_render_current_line(struct gb_state *gb_state) {
             u16 col = 0;
             if (use_col) {
                 u8 palidx = attr & 7;
-                col = palette_get_col(gb_state->io_lcd_BGPD, palidx, colidx);
+                col = palette_get_col(v->BGPD, palidx, colidx);
             } else
                 col = palette_get_gray(bgwin_palette, colidx);
             pixbuf[x + y * GB_LCD_WIDTH] = col;
@@ -261,51 +752,55 @@ static void lcd_render_current_line(struct gb_state *gb_state) {
 
             u16 col = 0;
             if (use_col)
-                col = palette_get_col(gb_state->io_lcd_BGPD, 0, colidx);
+                col = palette_get_col(v->BGPD, 0, colidx);
             else
                 col = palette_get_gray(bgwin_palette, colidx);
             pixbuf[x + y * GB_LCD_WIDTH] = col;
         }
     }
 
-    /* Draw any sprites (objects) on this line. */
-    for (int x = 0; x < GB_LCD_WIDTH; x++) {
-        for (int i = 0; i < num_objs; i++) {
-            int obj_tileoff_x = x - (objs[i].x - 8),
-                obj_tileoff_y = y - (objs[i].y - 16);
-
-            if (obj_tileoff_x < 0 || obj_tileoff_x >= 8)
+    /* Draw any sprites (objects) on this line. A pixel belongs to the sprite
+     * with the highest priority that is not transparent there, even if that
+     * sprite ends up behind the BG. */
+    u8 obj_claimed[160] = { 0 };
+    for (int i = 0; i < num_objs; i++) {
+        struct OAMentry *obj = &OAM[objs[i]];
+        int obj_tileoff_y = y - (obj->y - 16);
+
+        if (obj->flags & (1<<6)) /* Flip y */
+            obj_tileoff_y = obj_tile_height - 1 - obj_tileoff_y;
+
+        int tiledata_off = obj->tile * 16 + obj_tileoff_y * 2;
+        if (use_col && obj->flags & (1<<3))
+            tiledata_off += VRAM_BANKSIZE;
+        u8 b1 = obj_tiledata[tiledata_off];
+        u8 b2 = obj_tiledata[tiledata_off + 1];
+
+        for (int obj_tileoff_x = 0; obj_tileoff_x < 8; obj_tileoff_x++) {
+            int x = obj->x - 8 + obj_tileoff_x;
+            if (x < 0 || x >= GB_LCD_WIDTH || obj_claimed[x])
                 continue;
 
-            if (objs[i].flags & (1<<5)) /* Flip x */
-                obj_tileoff_x = 7 - obj_tileoff_x;
-            if (objs[i].flags & (1<<6)) /* Flip y */
-                obj_tileoff_y = obj_tile_height - 1 - obj_tileoff_y;
-
-            int obj_tileoff = obj_tileoff_x + obj_tileoff_y * 8;
-            int shift = 7 - obj_tileoff % 8;
-            int tiledata_off = objs[i].tile * 16 + obj_tileoff/8*2;
-            if (use_col && objs[i].flags & (1<<3))
-                tiledata_off += VRAM_BANKSIZE;
-            u8 b1 = obj_tiledata[tiledata_off];
-            u8 b2 = obj_tiledata[tiledata_off + 1];
+            int shift = obj->flags & (1<<5) ? /* Flip x */
+                obj_tileoff_x : 7 - obj_tileoff_x;
             u8 colidx = ((b1 >> shift) & 1) |
                        (((b2 >> shift) & 1) << 1);
+            if (colidx == 0)
+                continue;
 
-            if (colidx != 0) {
-                if (objs[i].flags & (1<<7)) /* OBJ-to-BG prio */
-                    if (pixbuf[x + y * GB_LCD_WIDTH] > 0)
-                        continue;
-                u16 col = 0;
-                if (use_col) {
-                    u8 palidx = objs[i].flags & 7;
-                    col = palette_get_col(gb_state->io_lcd_OBPD, palidx, colidx);
-                } else {
-                    u8 pal = objs[i].flags & (1<<4) ? obj_palette2 : obj_palette1;
-                    col = palette_get_gray(pal, colidx);
-                }
-                pixbuf[x + y * GB_LCD_WIDTH] = col;
+            obj_claimed[x] = 1;
+            if (obj->flags & (1<<7)) /* OBJ-to-BG prio */
+                if (pixbuf[x + y * GB_LCD_WIDTH] > 0)
+                    continue;
+            u16 col = 0;
+            if (use_col) {
+                u8 palidx = obj->flags & 7;
+                col = palette_get_col(v->OBPD, palidx, colidx);
+            } else {
+                u8 pal = obj->flags & (1<<4) ? obj_palette2 : obj_palette1;
+                col = palette_get_gray(pal, colidx);
             }
+            pixbuf[x + y * GB_LCD_WIDTH] = col;
         }
     }
 }
@@ -3,7 +3,30 @@
 
 #include "types.h"
 
+/* Memory the renderer depends on, see lcd_notify_write. */
+enum lcd_write_kind {
+    LCD_WRITE_VRAM, /* offset into mem_VRAM (all banks) */
+    LCD_WRITE_OAM,  /* offset into mem_OAM */
+    LCD_WRITE_REG,  /* offset is the I/O address (e.g., 0xff40 for LCDC) */
+    LCD_WRITE_BGPD, /* offset into io_lcd_BGPD */
+    LCD_WRITE_OBPD, /* offset into io_lcd_OBPD */
+};
+
 int lcd_init(struct gb_state *s);
+
+/* Stop the render thread (if any) and free everything from lcd_init. */
+void lcd_free(struct gb_state *s);
 void lcd_step(struct gb_state *s);
 
+/* Should be called by the MMU for every write to VRAM, OAM or any of the
+ * registers used for rendering (with the value that will be stored), right
+ * before the value is stored. */
+void lcd_notify_write(struct gb_state *s, enum lcd_write_kind kind,
+        u16 offset, u8 value);
+
+/* Should be called after changing VRAM, OAM or the rendering registers
+ * without the MMU (e.g., restoring a snapshot), so the renderer picks up the
+ * new state. */
+void lcd_resync(struct gb_state *s);
+
 #endif
@@ -16,6 +16,8 @@
 #include "hwdefs.h"
 #include "types.h"
 #include "emu.h"
+#include "audio.h"
+#include "lcd.h"
 
 struct gb_state gb_state;
 struct player_input input;
@@ -28,6 +30,9 @@ static retro_audio_sample_batch_t audio_batch_cb;
 static retro_input_poll_t input_poll_cb;
 static retro_input_state_t input_state_cb;
 
+/* Frontend accepts NULL for frames identical to the previous one. */
+static bool can_dupe;
+
 void retro_set_environment(retro_environment_t cb) {
     env_cb = cb;
 
@@ -46,6 +51,9 @@ void retro_set_environment(retro_environment_t cb) {
     enum retro_pixel_format pixfmt = RETRO_PIXEL_FORMAT_0RGB1555;
     if (!env_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &pixfmt))
         fprintf(stderr, "Format RGB555 not supported!\n");
+
+    if (!env_cb(RETRO_ENVIRONMENT_GET_CAN_DUPE, &can_dupe))
+        can_dupe = false;
 }
 void retro_set_video_refresh(retro_video_refresh_t cb) {
     video_cb = cb;
@@ -74,6 +82,7 @@ void retro_init(void) {
     memset(framebuf, 0, framebuf_size);
 }
 void retro_deinit(void) {
+    lcd_free(&gb_state);
     free(framebuf);
     framebuf = NULL;
 }
@@ -103,7 +112,7 @@ void retro_get_system_av_info(struct retro_system_av_info *info) {
 
     info->timing.fps = 1. * GB_FREQ / GB_LCD_FRAME_CLKS;
     printf("Requesting %f fps\n", info->timing.fps);
-    info->timing.sample_rate = 44100;
+    info->timing.sample_rate = AUDIO_SAMPLE_RATE;
 }
 
 /* Sets device to be used for player 'port'. */
@@ -138,6 +147,12 @@ void update_inputs(void) {
 }
 
 void render_frame(void) {
+    if (can_dupe && gb_state.emu_state->lcd_frame_dup) {
+        video_cb(NULL, GB_LCD_WIDTH, GB_LCD_HEIGHT,
+                GB_LCD_WIDTH * sizeof(pixel_t));
+        return;
+    }
+
     if (gb_state.gb_type == GB_TYPE_CGB) {
         /* The gameboy uses a BGR555 format, so swap around colors. */
         for (int y = 0; y < GB_LCD_HEIGHT; y++)
@@ -163,13 +178,34 @@ void render_frame(void) {
     video_cb(framebuf, GB_LCD_WIDTH, GB_LCD_HEIGHT, GB_LCD_WIDTH * sizeof(pixel_t));
 }
 
+/* Hand all samples of the last frame to the frontend in one go: calling
+ * audio_cb for every sample is slow on some frontends. The emulator produces
+ * exactly as many samples as the emulated cycles of the frame amount to at
+ * timing.sample_rate. */
+void output_audio(void) {
+    struct emu_state *es = gb_state.emu_state;
+    size_t done = 0;
+
+    while (done < (size_t)es->audio_buf_len) {
+        size_t n = audio_batch_cb(&es->audio_buf[done * AUDIO_CHANNELS],
+                es->audio_buf_len - done);
+        if (!n)
+            break;
+        done += n;
+    }
+}
+
 /* Runs the game for one video frame. */
 void retro_run(void) {
     update_inputs();
 
     emu_step_frame(&gb_state);
 
+    struct perf_timer timer;
+    perf_begin(gb_state.emu_state->perf, &timer);
     render_frame();
+    perf_end(gb_state.emu_state->perf, PERF_FRONTEND, &timer);
+    output_audio();
 }
 
 /* Returns size to serialize internal state (save state). */
@@ -201,6 +237,8 @@ bool retro_load_game(const struct retro_game_info *info) {
     struct emu_args args;
     memset(&args, 0, sizeof(struct emu_args));
     args.rom_filename = (char*)info->path;
+    args.audio_enable = 1;
+    args.audio_sample_rate = AUDIO_SAMPLE_RATE;
 
     if (emu_init(&gb_state, &args)) {
         fprintf(stderr, "Initialization failed\n");
@@ -220,6 +258,7 @@ bool retro_load_game_special(unsigned game_type,
 /* Unloads a currently loaded game. */
 void retro_unload_game(void) {
     /* TODO: save extram */
+    lcd_free(&gb_state);
 }
 
 /* Gets region (i.e., country) of game. */
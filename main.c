@@ -17,9 +17,40 @@
 #include "debugger.h"
 #include "gui.h"
 #include "fileio.h"
+#include "record.h"
+#include "fbtrace.h"
+#include "movie.h"
+#include "trace.h"
+#include "gdbstub.h"
+#include "reverse.h"
+#include "breakpoint.h"
 
 #define GUI_WINDOW_TITLE "KoenGB"
 #define GUI_ZOOM      4
+#define DEFAULT_MAX_FRAMESKIP 4
+#define AUDIO_TARGET_LATENCY 0.05 /* Seconds of audio kept queued. */
+#define AUDIO_MAX_RATE_DELTA 0.005 /* Max resampling adjustment (0.5%). */
+#define PROFILE_TOP 20 /* Functions and instructions shown by --profile. */
+
+/* Options for this frontend only, the rest goes into struct emu_args. */
+struct main_args {
+    int max_frameskip;
+    bool audio; /* Play audio (and use it for pacing). */
+    char *record_basename;
+    bool headless; /* No GUI, no pacing. */
+    unsigned max_frames; /* Stop after this many frames, 0 for no limit. */
+    u64 max_cycles; /* Stop at exactly these totals, 0 for no limit. */
+    u64 max_instructions;
+    struct bp_cond stop_cond; /* Stop when true (checked every frame). */
+    char *fbtrace_filename;
+    char *fbtrace_golden_filename;
+    unsigned hash_interval; /* Print hashes every N frames, 0 for never. */
+    char *movie_record_filename;
+    char *movie_play_filename;
+    char *profile_filename; /* Call stacks written by --profile. */
+    bool perf; /* Print host time per part of the emulator on exit. */
+    int gdb_port; /* Wait for GDB to connect on this port, 0 for none. */
+};
 
 
 void print_usage(char *progname) {
@@ -28,10 +59,74 @@ void print_usage(char *progname) {
     printf("Options:\n");
     printf(" -S, --break-start      Break into debugger before executing first "
             "instruction.\n");
-    printf(" -a, --audio            Enable (WIP) audio\n");
+    printf(" -a, --audio            Enable audio\n");
+    printf(" -H, --headless         Run without GUI, as fast as possible.\n");
+    printf(" -n, --frames=N         Stop after N frames.\n");
+    printf(" -C, --stop-cycles=N    Stop after exactly N cycles (at the first "
+            "instruction\n");
+    printf("                        boundary).\n");
+    printf(" -I, --stop-instructions=N\n");
+    printf("                        Stop after exactly N instructions.\n");
+    printf(" -c, --stop-if=COND     Stop when COND (e.g. '[a000] == 0', hex) "
+            "holds at the end\n");
+    printf("                        of a frame. The exit status is 1 if another "
+            "limit stops\n");
+    printf("                        the emulator first.\n");
+    printf(" -i, --hash-interval=N  Print hashes of the framebuffer and "
+            "machine state every\n");
+    printf("                        N frames.\n");
+    printf(" -t, --fbtrace=FILE     Write a trace of the changes to the "
+            "framebuffer.\n");
+    printf(" -g, --fbtrace-golden=FILE\n");
+    printf("                        Compare against a framebuffer trace, stop "
+            "(with exit\n");
+    printf("                        status 1) at the first frame that "
+            "differs.\n");
+    printf(" -P, --profile=FILE     Profile the game's code: print the hottest "
+            "functions and\n");
+    printf("                        instructions on exit, and write call "
+            "stacks for flamegraph\n");
+    printf("                        tools to FILE.\n");
+    printf(" -T, --perf             Measure the host time spent in each part of "
+            "the emulator,\n");
+    printf("                        print it (per frame) on exit.\n");
+    printf(" -x, --trace=FILE       Write a binary trace of the last executed "
+            "instructions to\n");
+    printf("                        FILE (read it with tools/tracedump).\n");
+    printf(" -X, --trace-mmu        Also trace memory accesses.\n");
+    printf(" -z, --trace-records=N  Keep the last N records in the trace "
+            "(default %d).\n", TRACE_DEFAULT_RECORDS);
+    printf(" -G, --gdb=PORT         Wait for GDB to connect on localhost:PORT, "
+            "and debug\n");
+    printf("                        with it (target remote :PORT).\n");
+    printf(" -u, --reverse[=N]      Snapshot the machine every N frames "
+            "(default %d) to allow\n", REVERSE_DEFAULT_INTERVAL);
+    printf("                        reverse execution in the debugger.\n");
     printf(" -d, --print-disas      Print every instruction before executing "
             "it.\n");
     printf(" -m, --print-mmu        Print every memory access\n");
+    printf(" -f, --frameskip=N      Skip rendering of at most N consecutive "
+            "frames when the\n");
+    printf("                        host can't keep up (default %d, 0 "
+            "disables).\n", DEFAULT_MAX_FRAMESKIP);
+    printf(" -w, --movie-record=FILE\n");
+    printf("                        Record the input to a movie, starting at "
+            "power-on (without\n");
+    printf("                        loading saves) or the state given with "
+            "-l.\n");
+    printf(" -p, --movie-play=FILE  Play back a movie (the ROM must still be "
+            "specified).\n");
+    printf(" -R, --record=NAME      Record video and audio to NAME.y4m and "
+            "NAME.wav (disables\n");
+    printf("                        frameskip).\n");
+    printf(" -r, --render=MODE      How to render the LCD: 'immediate' (every "
+            "line at\n");
+    printf("                        H-Blank, default), 'deferred' (whole "
+            "frame at V-Blank),\n");
+    printf("                        'threaded' (on a render thread) or "
+            "'pipelined' (threaded,\n");
+    printf("                        showing each frame one frame "
+            "later).\n");
     printf(" -b, --bios=FILE        Use the specified bios (default is no "
             "bios).\n");
     printf(" -l, --load-state=FILE  Load the gamestate from a file (makes ROM "
@@ -43,8 +138,11 @@ void print_usage(char *progname) {
     printf("                        automatically search for this file).\n");
 }
 
-int parse_args(int argc, char **argv, struct emu_args *emu_args) {
+int parse_args(int argc, char **argv, struct emu_args *emu_args,
+        struct main_args *main_args) {
     memset(emu_args, 0, sizeof(struct emu_args));
+    memset(main_args, 0, sizeof(struct main_args));
+    main_args->max_frameskip = DEFAULT_MAX_FRAMESKIP;
 
     if (argc == 1) {
         print_usage(argv[0]);
@@ -55,15 +153,35 @@ int parse_args(int argc, char **argv, struct emu_args *emu_args) {
         static struct option long_options[] = {
             {"break-start",  no_argument,        0,  'S'},
             {"audio",        no_argument,        0,  'a'},
+            {"headless",     no_argument,        0,  'H'},
+            {"frames",       required_argument,  0,  'n'},
+            {"stop-cycles",  required_argument,  0,  'C'},
+            {"stop-instructions", required_argument, 0, 'I'},
+            {"stop-if",      required_argument,  0,  'c'},
+            {"hash-interval", required_argument, 0,  'i'},
+            {"fbtrace",      required_argument,  0,  't'},
+            {"fbtrace-golden", required_argument, 0, 'g'},
+            {"profile",      required_argument,  0,  'P'},
+            {"perf",         no_argument,        0,  'T'},
+            {"trace",        required_argument,  0,  'x'},
+            {"trace-mmu",    no_argument,        0,  'X'},
+            {"trace-records", required_argument, 0,  'z'},
+            {"gdb",          required_argument,  0,  'G'},
+            {"reverse",      optional_argument,  0,  'u'},
             {"print-disas",  no_argument,        0,  'd'},
             {"print-mmu",    no_argument,        0,  'm'},
+            {"frameskip",    required_argument,  0,  'f'},
+            {"movie-record", required_argument,  0,  'w'},
+            {"movie-play",   required_argument,  0,  'p'},
+            {"record",       required_argument,  0,  'R'},
+            {"render",       required_argument,  0,  'r'},
             {"bios",         required_argument,  0,  'b'},
             {"load-state",   required_argument,  0,  'l'},
             {"load-save",    required_argument,  0,  'e'},
             {0, 0, 0, 0}
         };
 
-        int c = getopt_long(argc, argv, "Sadmb:l:e:", long_options, NULL);
+        int c = getopt_long(argc, argv, "SaHn:C:I:c:i:t:g:P:Tx:Xz:G:u::dmf:w:p:R:r:b:l:e:", long_options, NULL);
 
         if (c == -1)
             break;
@@ -74,7 +192,73 @@ int parse_args(int argc, char **argv, struct emu_args *emu_args) {
                 break;
 
             case 'a':
-                emu_args->audio_enable = 1;
+                main_args->audio = 1;
+                break;
+
+            case 'H':
+                main_args->headless = 1;
+                break;
+
+            case 'n':
+                main_args->max_frames = atoi(optarg);
+                break;
+
+            case 'C':
+                main_args->max_cycles = strtoull(optarg, NULL, 0);
+                break;
+
+            case 'I':
+                main_args->max_instructions = strtoull(optarg, NULL, 0);
+                break;
+
+            case 'c':
+                if (bp_parse_cond(optarg, &main_args->stop_cond)) {
+                    fprintf(stderr, "Invalid condition: %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'i':
+                main_args->hash_interval = atoi(optarg);
+                break;
+
+            case 't':
+                main_args->fbtrace_filename = optarg;
+                break;
+
+            case 'g':
+                main_args->fbtrace_golden_filename = optarg;
+                break;
+
+            case 'P':
+                emu_args->profile = 1;
+                main_args->profile_filename = optarg;
+                break;
+
+            case 'T':
+                emu_args->perf = 1;
+                main_args->perf = 1;
+                break;
+
+            case 'x':
+                emu_args->trace_filename = optarg;
+                break;
+
+            case 'X':
+                emu_args->trace_mmu = 1;
+                break;
+
+            case 'z':
+                emu_args->trace_records = strtoull(optarg, NULL, 0);
+                break;
+
+            case 'G':
+                main_args->gdb_port = atoi(optarg);
+                break;
+
+            case 'u':
+                emu_args->reverse_interval = optarg ? atoi(optarg) :
+                    REVERSE_DEFAULT_INTERVAL;
                 break;
 
             case 'd':
@@ -85,6 +269,37 @@ int parse_args(int argc, char **argv, struct emu_args *emu_args) {
                 emu_args->print_mmu = 1;
                 break;
 
+            case 'f':
+                main_args->max_frameskip = atoi(optarg);
+                break;
+
+            case 'w':
+                main_args->movie_record_filename = optarg;
+                break;
+
+            case 'p':
+                main_args->movie_play_filename = optarg;
+                break;
+
+            case 'R':
+                main_args->record_basename = optarg;
+                break;
+
+            case 'r':
+                if (strcmp(optarg, "immediate") == 0)
+                    emu_args->render_mode = LCD_RENDER_IMMEDIATE;
+                else if (strcmp(optarg, "deferred") == 0)
+                    emu_args->render_mode = LCD_RENDER_DEFERRED;
+                else if (strcmp(optarg, "threaded") == 0)
+                    emu_args->render_mode = LCD_RENDER_THREADED;
+                else if (strcmp(optarg, "pipelined") == 0)
+                    emu_args->render_mode = LCD_RENDER_PIPELINED;
+                else {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+
             case 'b':
                 emu_args->bios_filename = optarg;
                 break;
@@ -111,36 +326,143 @@ int parse_args(int argc, char **argv, struct emu_args *emu_args) {
 
     emu_args->rom_filename = argv[optind];
 
+    if (main_args->headless)
+        main_args->audio = 0;
+
+    if (main_args->movie_record_filename && main_args->movie_play_filename) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (main_args->movie_record_filename && !emu_args->state_filename)
+        emu_args->no_save_load = 1;
+
+    /* Recordings and traces need every frame, and recordings need audio even
+     * if we don't play it. */
+    if (main_args->record_basename || main_args->fbtrace_filename ||
+            main_args->fbtrace_golden_filename)
+        main_args->max_frameskip = 0;
+    if (main_args->record_basename)
+        emu_args->audio_enable = 1;
+    if (main_args->audio)
+        emu_args->audio_enable = 1;
+
     return 0;
 }
 
 
+static double time_now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+static double emulated_time(struct gb_state *s) {
+    return s->emu_state->time_seconds + 1. * s->emu_state->time_cycles / GB_FREQ;
+}
+
+/* Pace the emulator by the audio device: wait until the queue has drained to
+ * the target latency, and use dynamic rate control to hold it there. When the
+ * queue is below target (we're not keeping up), produce up to 0.5% more
+ * samples per frame (and vice versa), which is inaudible but enough to absorb
+ * the difference between the host and GameBoy clocks. Without adjust_rate
+ * (when recording) the rate stays nominal. Returns whether we are running
+ * behind. */
+static bool frame_pace_audio(struct gb_state *s, bool adjust_rate) {
+    const double target = AUDIO_TARGET_LATENCY * AUDIO_SAMPLE_RATE;
+    int buffered = gui_audio_buffered();
+
+    if (buffered > target) {
+        gui_sleep((buffered - target) / AUDIO_SAMPLE_RATE);
+        buffered = gui_audio_buffered();
+    }
+
+    double error = (target - buffered) / target;
+    if (error > 1)
+        error = 1;
+    if (error < -1)
+        error = -1;
+    emu_set_audio_rate_adjust(s,
+            adjust_rate ? 1 + AUDIO_MAX_RATE_DELTA * error : 1);
+
+    return buffered < target / 2;
+}
 
 int main(int argc, char *argv[]) {
     struct gb_state gb_state;
 
     struct emu_args emu_args;
-    if (parse_args(argc, argv, &emu_args))
+    struct main_args main_args;
+    if (parse_args(argc, argv, &emu_args, &main_args))
         return 1;
 
+    struct movie *movie = NULL;
+    if (main_args.movie_play_filename) {
+        movie = movie_play(main_args.movie_play_filename);
+        if (!movie)
+            return 1;
+        movie_anchor(movie, &emu_args.state_buf, &emu_args.state_buf_size);
+        if (!emu_args.state_buf)
+            emu_args.no_save_load = 1;
+    }
+
     if (emu_init(&gb_state, &emu_args)) {
         fprintf(stderr, "Initialization failed\n");
         return 1;
     }
 
+    if (movie && movie_check_rom(movie, &gb_state))
+        return 1;
+    if (main_args.movie_record_filename) {
+        movie = movie_record(main_args.movie_record_filename, &gb_state,
+                emu_args.state_filename != NULL);
+        if (!movie)
+            return 1;
+    }
+
+    if (main_args.gdb_port) {
+#ifdef NDEBUG
+        fprintf(stderr, "Debugger options need a debug build\n");
+        return 1;
+#else
+        gb_state.emu_state->gdb = gdb_open(main_args.gdb_port);
+        if (!gb_state.emu_state->gdb)
+            return 1;
+        gb_state.emu_state->dbg_break_next = 1;
+#endif
+    }
+
     /* Initialize frontend-specific GUI */
-    if (gui_lcd_init(GB_LCD_WIDTH, GB_LCD_HEIGHT, GUI_ZOOM, GUI_WINDOW_TITLE)) {
+    if (!main_args.headless && gui_lcd_init(GB_LCD_WIDTH, GB_LCD_HEIGHT,
+                GUI_ZOOM, GUI_WINDOW_TITLE)) {
         fprintf(stderr, "Couldn't initialize GUI LCD\n");
         return 1;
     }
-    if (emu_args.audio_enable) {
-        if (gui_audio_init(AUDIO_SAMPLE_RATE, AUDIO_CHANNELS, AUDIO_SNDBUF_SIZE,
-                    gb_state.emu_state->audio_sndbuf)) {
+    if (main_args.audio) {
+        if (gui_audio_init(AUDIO_SAMPLE_RATE, AUDIO_CHANNELS)) {
             fprintf(stderr, "Couldn't initialize GUI audio\n");
             return 1;
         }
     }
 
+    struct recorder *recorder = NULL;
+    if (main_args.record_basename) {
+        recorder = record_open(main_args.record_basename, AUDIO_SAMPLE_RATE);
+        if (!recorder) {
+            fprintf(stderr, "Couldn't start recording\n");
+            return 1;
+        }
+    }
+
+    struct fbtrace *fbtrace = NULL;
+    if (main_args.fbtrace_filename || main_args.fbtrace_golden_filename) {
+        fbtrace = fbtrace_open(main_args.fbtrace_filename,
+                main_args.fbtrace_golden_filename);
+        if (!fbtrace) {
+            fprintf(stderr, "Couldn't start framebuffer trace\n");
+            return 1;
+        }
+    }
+
     printf("==========================\n");
     printf("=== Starting execution ===\n");
     printf("==========================\n\n");
@@ -151,19 +473,113 @@ int main(int argc, char *argv[]) {
     struct player_input input_state;
     memset(&input_state, 0, sizeof(struct player_input));
 
+    /* With audio, the audio device sets the pace (see frame_pace_audio).
+     * Otherwise, sleep until the (host) time matches the emulated time. We
+     * don't use vsync for this, as the host's refresh rate can be anything.
+     * Automatic frameskip: when we fall behind, stop rendering (but keep
+     * emulating) for a few frames. */
+    const double frame_period = 1. * GB_LCD_FRAME_CLKS / GB_FREQ;
+    double next_frame_time = time_now();
+    double frame_emu_time = emulated_time(&gb_state);
+    int frames_skipped = 0;
+    bool skip_render = 0;
+    unsigned frames = 0;
+    int ret = 0;
+
     while (!gb_state.emu_state->quit) {
-        emu_step_frame(&gb_state);
+        bool limit = emu_step_frame_until(&gb_state, main_args.max_cycles,
+                main_args.max_instructions);
+        frames++;
+
+        if (gb_state.emu_state->gdb)
+            gdb_poll(gb_state.emu_state->gdb, &gb_state);
+
+        if (main_args.hash_interval && frames % main_args.hash_interval == 0)
+            printf("Frame %u: framebuffer %016llx state %016llx\n", frames,
+                    (unsigned long long)emu_hash_framebuffer(&gb_state),
+                    (unsigned long long)emu_hash_state(&gb_state));
 
-        gui_input_poll(&input_state);
+        if (fbtrace && fbtrace_frame(fbtrace, gb_state.emu_state->lcd_pixbuf,
+                    gb_state.emu_state->lcd_frame_dup)) {
+            ret = 1;
+            break;
+        }
+
+        double t = emulated_time(&gb_state);
+        if (recorder)
+            record_frame(recorder, gb_state.gb_type == GB_TYPE_CGB,
+                    gb_state.emu_state->lcd_pixbuf,
+                    gb_state.emu_state->audio_buf,
+                    gb_state.emu_state->audio_buf_len, t - frame_emu_time);
+
+        if (main_args.stop_cond.op != BP_COND_NONE &&
+                bp_eval_cond(&gb_state, &main_args.stop_cond)) {
+            printf("Stop condition met in frame %u\n", frames);
+            break;
+        }
+        if (limit || frames == main_args.max_frames) {
+            if (main_args.stop_cond.op != BP_COND_NONE)
+                ret = 1;
+            break;
+        }
+        if (!main_args.headless)
+            gui_input_poll(&input_state);
+        if (movie && movie_input(movie, &input_state)) {
+            /* Hand over control to the player, if there is one. */
+            movie_close(movie);
+            movie = NULL;
+            if (main_args.headless)
+                break;
+        }
         emu_process_inputs(&gb_state, &input_state);
 
-        gui_lcd_render_frame(gb_state.gb_type == GB_TYPE_CGB,
-                gb_state.emu_state->lcd_pixbuf);
+        if (main_args.headless) {
+            frame_emu_time = t;
+            continue;
+        }
+
+        if (!skip_render) {
+            struct perf_timer timer;
+            perf_begin(gb_state.emu_state->perf, &timer);
+            gui_lcd_render_frame(gb_state.gb_type == GB_TYPE_CGB,
+                    gb_state.emu_state->lcd_frame_dup ? NULL :
+                    gb_state.emu_state->lcd_pixbuf);
+            perf_end(gb_state.emu_state->perf, PERF_FRONTEND, &timer);
+        }
 
-        if (gb_state.emu_state->audio_enable) /* TODO */
-            audio_update(&gb_state);
+        bool behind;
+        if (main_args.audio) {
+            behind = frame_pace_audio(&gb_state, !recorder);
+            gui_audio_queue(gb_state.emu_state->audio_buf,
+                    gb_state.emu_state->audio_buf_len);
+        } else {
+            next_frame_time += t - frame_emu_time;
+
+            double now = time_now();
+            gui_sleep(next_frame_time - now);
+            behind = now > next_frame_time + frame_period;
+
+            /* Don't try to catch up on time we lost long ago. */
+            if (now > next_frame_time +
+                    frame_period * (main_args.max_frameskip + 1))
+                next_frame_time = now;
+        }
+        frame_emu_time = t;
+
+        /* Recordings need every frame, at the nominal audio rate. */
+        skip_render = !recorder && behind &&
+            frames_skipped < main_args.max_frameskip;
+        frames_skipped = skip_render ? frames_skipped + 1 : 0;
+        emu_set_render_skip(&gb_state, skip_render);
     }
 
+    if (recorder)
+        record_close(recorder);
+    if (fbtrace)
+        fbtrace_close(fbtrace);
+    if (movie)
+        movie_close(movie);
+
     if (gb_state.emu_state->extram_dirty)
         emu_save(&gb_state, 1, gb_state.emu_state->save_filename_out);
 
@@ -177,11 +593,40 @@ int main(int argc, char *argv[]) {
     int t_sec = endtime.tv_sec - starttime.tv_sec;
     double exectime = t_sec + (t_usec / 1000000.);
 
-    double emulated_secs = gb_state.emu_state->time_seconds +
-        gb_state.emu_state->time_cycles / 4194304.;
+    double emulated_secs = emulated_time(&gb_state);
+
+    if (main_args.max_cycles || main_args.max_instructions ||
+            main_args.stop_cond.op != BP_COND_NONE)
+        printf("\nStopped after %u frames, %llu cycles, %llu instructions.\n",
+                frames, (unsigned long long)emu_cycles(&gb_state),
+                (unsigned long long)gb_state.emu_state->time_instructions);
 
     printf("\nEmulated %f sec in %f sec WCT, %.0f%%.\n", emulated_secs, exectime,
             emulated_secs / exectime * 100);
 
-    return 0;
+    if (main_args.perf) {
+        struct perf_stats stats;
+        emu_perf_stats(&gb_state, PERF_CPU, &stats);
+        printf("Host time per frame (us, last %u frames):\n", stats.frames);
+        printf("  %-10s %10s %10s %10s\n", "", "min", "avg", "p99");
+        for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+            emu_perf_stats(&gb_state, c, &stats);
+            printf("  %-10s %10.1f %10.1f %10.1f\n", perf_counter_name(c),
+                    stats.min, stats.avg, stats.p99);
+        }
+    }
+
+    if (main_args.profile_filename) {
+        printf("\n");
+        emu_profile_report(&gb_state, PROFILE_TOP, main_args.profile_filename);
+    }
+
+    if (main_args.audio) {
+        unsigned underruns, overruns;
+        gui_audio_stats(&underruns, &overruns);
+        printf("Audio underruns: %u, overruns: %u\n", underruns, overruns);
+    }
+
+    lcd_free(&gb_state);
+    return ret;
 }
@@ -1,10 +1,16 @@
 #include <stdio.h>
 
 #include "mmu.h"
+#include "lcd.h"
+#include "audio.h"
 #include "hwdefs.h"
 #include "debugger.h"
+#include "perf.h"
+#include "trace.h"
+#include "breakpoint.h"
 
-#if 1
+/* Release builds (NDEBUG) leave out the debug prints and assertions. */
+#ifndef NDEBUG
 #define MMU_DEBUG_W(fmt, ...) \
     do { \
         if (s->emu_state->dbg_print_mmu) \
@@ -23,17 +29,27 @@
 
 #define mmu_error(fmt, ...) \
     do { \
+        if (s->emu_state->dbg_mem_access) { \
+            s->emu_state->dbg_mem_error = 1; \
+            break; \
+        } \
         printf("MMU Error: " fmt "\n", ##__VA_ARGS__); \
         dbg_run_debugger(s); \
     } while (0)
 
+#ifndef NDEBUG
 #define mmu_assert(cond) \
     do { \
-        if (!(cond)) { \
+        if (!(cond) && s->emu_state->dbg_mem_access) { \
+            s->emu_state->dbg_mem_error = 1; \
+        } else if (!(cond)) { \
             printf("MMU Assertion failed at %s:%d: " #cond "\n", __FILE__, __LINE__); \
             dbg_run_debugger(s); \
         } \
     } while (0)
+#else
+#define mmu_assert(cond) do { } while (0)
+#endif
 
 static void mmu_hdma_do(struct gb_state *s) {
     /* DMA one block (0x10 byte), should be called at start of H-Blank. */
@@ -102,11 +118,15 @@ static void mmu_hdma_start(struct gb_state *s, u8 lenmode) {
 }
 
 void mmu_step(struct gb_state *s) {
-    if (s->emu_state->lcd_entered_hblank && s->io_hdma_running)
+    if (s->emu_state->lcd_entered_hblank && s->io_hdma_running) {
+        struct perf_timer timer;
+        perf_begin(s->emu_state->perf, &timer);
         mmu_hdma_do(s);
+        perf_end(s->emu_state->perf, PERF_MMU, &timer);
+    }
 }
 
-void mmu_write(struct gb_state *s, u16 location, u8 value) {
+static void mmu_do_write(struct gb_state *s, u16 location, u8 value) {
     //MMU_DEBUG_W("Mem write (%x) %x: ", location, value);
     switch (location & 0xf000) {
     case 0x0000: /* 0000 - 1FFF */
@@ -192,10 +212,13 @@ void mmu_write(struct gb_state *s, u16 location, u8 value) {
         break;
     case 0x8000: /* 8000 - 9FFF */
     case 0x9000:
+    {
         MMU_DEBUG_W("VRAM (B%d)", s->mem_bank_vram);
-        s->mem_VRAM[s->mem_bank_vram * VRAM_BANKSIZE + location - 0x8000]
-            = value;
+        u16 offset = s->mem_bank_vram * VRAM_BANKSIZE + location - 0x8000;
+        lcd_notify_write(s, LCD_WRITE_VRAM, offset, value);
+        s->mem_VRAM[offset] = value;
         break;
+    }
     case 0xa000: /* A000 - BFFF */
     case 0xb000:
         if (s->mbc == 1) {
@@ -216,7 +239,7 @@ void mmu_write(struct gb_state *s, u16 location, u8 value) {
                 s->mem_EXTRAM[s->mem_mbc3_extram_rtc_select * EXTRAM_BANKSIZE + location - 0xa000] = value;
                 s->emu_state->extram_dirty = 1;
             } else if (s->mem_mbc3_extram_rtc_select >= 0x08 && s->mem_mbc3_extram_rtc_select <= 0x0c)
-                s->mem_RTC[s->mem_mbc3_extram_rtc_select] = value;
+                s->mem_RTC[s->mem_mbc3_extram_rtc_select - 0x08] = value;
             else
                 mmu_error("Writing to extram/rtc with invalid selection (%d) @%x, val=%x", s->mem_mbc3_extram_rtc_select, location, value);
         } else if (s->mbc == 5) {
@@ -248,6 +271,7 @@ void mmu_write(struct gb_state *s, u16 location, u8 value) {
         }
         if (location < 0xfea0) { /* FE00 - FE9F */
             MMU_DEBUG_W("Sprite attribute table (OAM)");
+            lcd_notify_write(s, LCD_WRITE_OAM, location - 0xfe00, value);
             s->mem_OAM[location - 0xfe00] = value;
             break;
         }
@@ -294,93 +318,93 @@ void mmu_write(struct gb_state *s, u16 location, u8 value) {
                 break;
             case 0xff10:
                 MMU_DEBUG_W("Sound channel 1 sweep");
-                s->io_sound_channel1_sweep = value;
+                audio_write(s, location, value);
                 break;
             case 0xff11:
                 MMU_DEBUG_W("Sound channel 1 length/pattern");
-                s->io_sound_channel1_length_pattern = value;
+                audio_write(s, location, value);
                 break;
             case 0xff12:
                 MMU_DEBUG_W("Sound channel 1 envelope");
-                s->io_sound_channel1_envelope = value;
+                audio_write(s, location, value);
                 break;
             case 0xff13:
                 MMU_DEBUG_W("Sound channel 1 freq lo");
-                s->io_sound_channel1_freq_lo = value;
+                audio_write(s, location, value);
                 break;
             case 0xff14:
                 MMU_DEBUG_W("Sound channel 1 freq hi");
-                s->io_sound_channel1_freq_hi = value;
+                audio_write(s, location, value);
                 break;
             case 0xff15:
                 MMU_DEBUG_W("Sound channel 2 sweep (unused)");
                 break;
             case 0xff16:
                 MMU_DEBUG_W("Sound channel 2 length/pattern");
-                s->io_sound_channel2_length_pattern = value;
+                audio_write(s, location, value);
                 break;
             case 0xff17:
                 MMU_DEBUG_W("Sound channel 2 envelope");
-                s->io_sound_channel2_envelope = value;
+                audio_write(s, location, value);
                 break;
             case 0xff18:
                 MMU_DEBUG_W("Sound channel 2 freq lo");
-                s->io_sound_channel2_freq_lo = value;
+                audio_write(s, location, value);
                 break;
             case 0xff19:
                 MMU_DEBUG_W("Sound channel 2 freq hi");
-                s->io_sound_channel2_freq_hi = value;
+                audio_write(s, location, value);
                 break;
             case 0xff1a:
                 MMU_DEBUG_W("Sound channel 3 enabled");
-                s->io_sound_channel3_enabled = value;
+                audio_write(s, location, value);
                 break;
             case 0xff1b:
                 MMU_DEBUG_W("Sound channel 3 length");
-                s->io_sound_channel3_length = value;
+                audio_write(s, location, value);
                 break;
             case 0xff1c:
                 MMU_DEBUG_W("Sound channel 3 level");
-                s->io_sound_channel3_level = value;
+                audio_write(s, location, value);
                 break;
             case 0xff1d:
                 MMU_DEBUG_W("Sound channel 3 freq lo");
-                s->io_sound_channel3_freq_lo = value;
+                audio_write(s, location, value);
                 break;
             case 0xff1e:
                 MMU_DEBUG_W("Sound channel 3 freq hi");
-                s->io_sound_channel3_freq_hi = value;
+                audio_write(s, location, value);
                 break;
             case 0xff1f:
                 MMU_DEBUG_W("Sound channel 4 sweep (unused)");
                 break;
             case 0xff20:
                 MMU_DEBUG_W("Sound channel 4 length");
-                s->io_sound_channel4_length = value;
+                audio_write(s, location, value);
                 break;
             case 0xff21:
                 MMU_DEBUG_W("Sound channel 4 envelope");
-                s->io_sound_channel4_envelope = value;
+                audio_write(s, location, value);
                 break;
             case 0xff22:
                 MMU_DEBUG_W("Sound channel 4 polynomial counter");
-                s->io_sound_channel4_poly = value;
+                audio_write(s, location, value);
                 break;
             case 0xff23:
                 MMU_DEBUG_W("Sound channel 4 Counter/consecutive; Inital");
-                s->io_sound_channel4_consec_initial = value;
+                audio_write(s, location, value);
                 break;
             case 0xff24:
                 MMU_DEBUG_W("Sound channel control");
-                s->io_sound_terminal_control = value;
+                audio_write(s, location, value);
                 break;
             case 0xff25:
                 MMU_DEBUG_W("Sound output terminal");
-                s->io_sound_out_terminal = value;
+                audio_write(s, location, value);
                 break;
             case 0xff26:
                 MMU_DEBUG_W("Sound enabled flags");
-                s->io_sound_enabled = (value & 0x80) | (s->io_sound_enabled & 0x7f);
+                audio_write(s, location, value);
                 break;
             case 0xff29:
                 /* Donkey Kong Land 3 accesses this... */
@@ -403,10 +427,11 @@ void mmu_write(struct gb_state *s, u16 location, u8 value) {
             case 0xff3e:
             case 0xff3f:
                 MMU_DEBUG_W("Sound channel 3 wave pattern RAM");
-                s->io_sound_channel3_ram[location-0xff30] = value;
+                audio_write(s, location, value);
                 break;
             case 0xff40:
                 MMU_DEBUG_W("LCD Control");
+                lcd_notify_write(s, LCD_WRITE_REG, location, value);
                 s->io_lcd_LCDC = value;
                 break;
             case 0xff41:
@@ -415,10 +440,12 @@ void mmu_write(struct gb_state *s, u16 location, u8 value) {
                 break;
             case 0xff42:
                 MMU_DEBUG_W("BG Scroll Y");
+                lcd_notify_write(s, LCD_WRITE_REG, location, value);
                 s->io_lcd_SCY = value;
                 break;
             case 0xff43:
                 MMU_DEBUG_W("BG Scroll X");
+                lcd_notify_write(s, LCD_WRITE_REG, location, value);
                 s->io_lcd_SCX = value;
                 break;
             case 0xff44:
@@ -436,27 +463,35 @@ void mmu_write(struct gb_state *s, u16 location, u8 value) {
                 /* Normally this transfer takes ~160ms (during which only HRAM
                  * is accessible) but it's okay to be instantaneous. Normally
                  * roms loop for ~200 cycles or so to wait.  */
-                for (unsigned i = 0; i < OAM_SIZE; i++)
-                    s->mem_OAM[i] = mmu_read(s, (value << 8) + i);
+                for (unsigned i = 0; i < OAM_SIZE; i++) {
+                    u8 b = mmu_read(s, (value << 8) + i);
+                    lcd_notify_write(s, LCD_WRITE_OAM, i, b);
+                    s->mem_OAM[i] = b;
+                }
                 break;
             case 0xff47:
                 MMU_DEBUG_W("Background palette");
+                lcd_notify_write(s, LCD_WRITE_REG, location, value);
                 s->io_lcd_BGP = value;
                 break;
             case 0xff48:
                 MMU_DEBUG_W("Object palette 0");
+                lcd_notify_write(s, LCD_WRITE_REG, location, value);
                 s->io_lcd_OBP0 = value;
                 break;
             case 0xff49:
                 MMU_DEBUG_W("Object palette 1");
+                lcd_notify_write(s, LCD_WRITE_REG, location, value);
                 s->io_lcd_OBP1 = value;
                 break;
             case 0xff4a:
                 MMU_DEBUG_W("Window Y");
+                lcd_notify_write(s, LCD_WRITE_REG, location, value);
                 s->io_lcd_WY = value;
                 break;
             case 0xff4b:
                 MMU_DEBUG_W("window X");
+                lcd_notify_write(s, LCD_WRITE_REG, location, value);
                 s->io_lcd_WX = value;
                 break;
             case 0xff4d:
@@ -503,6 +538,7 @@ void mmu_write(struct gb_state *s, u16 location, u8 value) {
             case 0xff69:
                 MMU_DEBUG_W("Background Palette Data idx=%d, inc=%d",
                         s->io_lcd_BGPI & 0x3f, s->io_lcd_BGPI & (1<<7)?1:0);
+                lcd_notify_write(s, LCD_WRITE_BGPD, s->io_lcd_BGPI & 0x3f, value);
                 s->io_lcd_BGPD[s->io_lcd_BGPI & 0x3f] = value;
                 if (s->io_lcd_BGPI & (1 << 7))
                     s->io_lcd_BGPI = (((s->io_lcd_BGPI & 0x3f) + 1) & 0x3f) | (1 << 7);
@@ -514,6 +550,7 @@ void mmu_write(struct gb_state *s, u16 location, u8 value) {
             case 0xff6b:
                 MMU_DEBUG_W("Sprite Palette Data idx=%d, inc=%d",
                         s->io_lcd_OBPI & 0x3f, s->io_lcd_OBPI & (1<<7)?1:0);
+                lcd_notify_write(s, LCD_WRITE_OBPD, s->io_lcd_OBPI & 0x3f, value);
                 s->io_lcd_OBPD[s->io_lcd_OBPI & 0x3f] = value;
                 if (s->io_lcd_OBPI & (1 << 7))
                     s->io_lcd_OBPI = (((s->io_lcd_OBPI & 0x3f) + 1) & 0x3f) | (1 << 7);
@@ -555,7 +592,7 @@ void mmu_write(struct gb_state *s, u16 location, u8 value) {
     }
 }
 
-u8 mmu_read(struct gb_state *s, u16 location) {
+static u8 mmu_do_read(struct gb_state *s, u16 location) {
     /*MMU_DEBUG_R("Mem read (%x): ", location); */
     if (s->in_bios && location < 0x100)
     {
@@ -604,7 +641,7 @@ u8 mmu_read(struct gb_state *s, u16 location) {
             if (s->mem_mbc3_extram_rtc_select < 0x04)
                 return s->mem_EXTRAM[s->mem_mbc3_extram_rtc_select * EXTRAM_BANKSIZE + location - 0xa000];
             else if (s->mem_mbc3_extram_rtc_select >= 0x08 && s->mem_mbc3_extram_rtc_select <= 0x0c)
-                return s->mem_RTC[s->mem_mbc3_extram_rtc_select];
+                return s->mem_RTC[s->mem_mbc3_extram_rtc_select - 0x08];
             else
                 mmu_error("Reading from extram/rtc with invalid selection (%d) @%x", s->mem_mbc3_extram_rtc_select, location);
         } else if (s->mbc == 5) {
@@ -624,7 +661,7 @@ u8 mmu_read(struct gb_state *s, u16 location) {
         MMU_DEBUG_R("WRAM B%d @%x", s->mem_bank_wram, location - 0xd000);
         return s->mem_WRAM[s->mem_bank_wram * WRAM_BANKSIZE + location - 0xd000];
     case 0xe000: /* E000 - FDFF */
-        return mmu_read(s, location - 0x2000); /* TODO XXX */
+        return mmu_do_read(s, location - 0x2000); /* TODO XXX */
         mmu_error("Reading from ECHO (0xc000 - 0xddff) B0: %x", location);
         return 0;
     case 0xf000:
@@ -680,67 +717,67 @@ u8 mmu_read(struct gb_state *s, u16 location) {
                 return s->interrupts_request;
             case 0xff10:
                 MMU_DEBUG_R("Sound channel 1 sweep");
-                return s->io_sound_channel1_sweep;
+                return audio_read(s, location);
             case 0xff11:
                 MMU_DEBUG_R("Sound channel 1 length/pattern");
-                return s->io_sound_channel1_length_pattern;
+                return audio_read(s, location);
             case 0xff12:
                 MMU_DEBUG_R("Sound channel 1 envelope");
-                return s->io_sound_channel1_envelope;
+                return audio_read(s, location);
             case 0xff13:
                 MMU_DEBUG_R("Sound channel 1 freq lo");
-                return s->io_sound_channel1_freq_lo;
+                return audio_read(s, location);
             case 0xff14:
                 MMU_DEBUG_R("Sound channel 1 freq hi");
-                return s->io_sound_channel1_freq_hi;
+                return audio_read(s, location);
             case 0xff16:
                 MMU_DEBUG_R("Sound channel 2 length/pattern");
-                return s->io_sound_channel2_length_pattern;
+                return audio_read(s, location);
             case 0xff17:
                 MMU_DEBUG_R("Sound channel 2 envelope");
-                return s->io_sound_channel2_envelope;
+                return audio_read(s, location);
             case 0xff18:
                 MMU_DEBUG_R("Sound channel 2 freq lo");
-                return s->io_sound_channel2_freq_lo;
+                return audio_read(s, location);
             case 0xff19:
                 MMU_DEBUG_R("Sound channel 2 freq hi");
-                return s->io_sound_channel2_freq_hi;
+                return audio_read(s, location);
             case 0xff1a:
                 MMU_DEBUG_R("Sound channel 3 enabled");
-                return s->io_sound_channel3_enabled;
+                return audio_read(s, location);
             case 0xff1b:
                 MMU_DEBUG_R("Sound channel 3 length");
-                return s->io_sound_channel3_length;
+                return audio_read(s, location);
             case 0xff1c:
                 MMU_DEBUG_R("Sound channel 3 level");
-                return s->io_sound_channel3_level;
+                return audio_read(s, location);
             case 0xff1d:
                 MMU_DEBUG_R("Sound channel 3 freq lo");
-                return s->io_sound_channel3_freq_lo;
+                return audio_read(s, location);
             case 0xff1e:
                 MMU_DEBUG_R("Sound channel 3 freq hi");
-                return s->io_sound_channel3_freq_hi;
+                return audio_read(s, location);
             case 0xff20:
                 MMU_DEBUG_R("Sound channel 4 length");
-                return s->io_sound_channel4_length;
+                return audio_read(s, location);
             case 0xff21:
                 MMU_DEBUG_R("Sound channel 4 envelope");
-                return s->io_sound_channel4_envelope;
+                return audio_read(s, location);
             case 0xff22:
                 MMU_DEBUG_R("Sound channel 4 polynomial counter");
-                return s->io_sound_channel4_poly;
+                return audio_read(s, location);
             case 0xff23:
                 MMU_DEBUG_R("Sound channel 4 Counter/consecutive; Inital");
-                return s->io_sound_channel4_consec_initial;
+                return audio_read(s, location);
             case 0xff24:
                 MMU_DEBUG_R("Sound channel control");
-                return s->io_sound_terminal_control;
+                return audio_read(s, location);
             case 0xff25:
                 MMU_DEBUG_R("Sound output terminal");
-                return s->io_sound_out_terminal;
+                return audio_read(s, location);
             case 0xff26:
                 MMU_DEBUG_R("Sound enabled flags");
-                return s->io_sound_enabled;
+                return audio_read(s, location);
             case 0xff29:
                 /* Donkey Kong Land 3 accesses this... */
                 MMU_DEBUG_R("Unknown sound reg");
@@ -762,7 +799,7 @@ u8 mmu_read(struct gb_state *s, u16 location) {
             case 0xff3e:
             case 0xff3f:
                 MMU_DEBUG_R("Waveform pattern RAM @%.4x", location);
-                return 0xff; // TODO
+                return audio_read(s, location);
             case 0xff40:
                 MMU_DEBUG_R("LCD Control (%04x: %02x)", location, s->io_lcd_LCDC);
                 return s->io_lcd_LCDC;
@@ -841,6 +878,87 @@ u8 mmu_read(struct gb_state *s, u16 location) {
     return 0;
 }
 
+int mmu_bank(struct gb_state *s, u16 location) {
+    if (location >= 0x4000 && location < 0x8000) {
+        int bank = s->mem_bank_rom;
+        if (s->mbc == 1 && s->mem_mbc1_romram_select == 0)
+            bank |= s->mem_mbc1_rombankupper << 5;
+        return bank & (s->mem_num_banks_rom - 1);
+    }
+    if (location >= 0xd000 && location < 0xe000)
+        return s->mem_bank_wram;
+    return 0;
+}
+
+/* Only the slow paths are timed: MBC registers and I/O ports, which also
+ * cover DMA and catching up the APU. */
+static bool mmu_is_slow_path(u16 location, bool write) {
+    return (write && location < 0x8000) ||
+        (location >= 0xff00 && location < 0xff80);
+}
+
+/* Whether there's any watchpoint of kind on the page of location. */
+static inline bool mmu_watched(struct gb_state *s, int kind, u16 location) {
+#ifndef NDEBUG
+    return bp_watch_marked(s->emu_state->breakpoints, kind, location);
+#else
+    (void)s; (void)kind; (void)location;
+    return 0;
+#endif
+}
+
+static void mmu_watch(struct gb_state *s, int kind, u16 location, u8 value) {
+    if (mmu_watched(s, kind, location) &&
+            bp_check_watch(s->emu_state->breakpoints, s, kind, location, value))
+        s->emu_state->dbg_break_next = 1;
+}
+
+u8 mmu_read(struct gb_state *s, u16 location) {
+    struct perf *perf = s->emu_state->perf;
+    struct perf_timer timer;
+    u8 value;
+
+    if (!perf && !s->emu_state->trace_mmu &&
+            !mmu_watched(s, BP_READ, location))
+        return mmu_do_read(s, location);
+
+    bool timed = perf && mmu_is_slow_path(location, 0);
+    if (timed)
+        perf_begin(perf, &timer);
+    value = mmu_do_read(s, location);
+    if (timed)
+        perf_end(perf, PERF_MMU, &timer);
+
+    if (s->emu_state->trace_mmu)
+        trace_mem(s->emu_state->trace, s, TRACE_READ, location, value);
+    mmu_watch(s, BP_READ, location, value);
+    return value;
+}
+
+void mmu_write(struct gb_state *s, u16 location, u8 value) {
+    struct perf *perf = s->emu_state->perf;
+    struct perf_timer timer;
+
+    if (!perf && !s->emu_state->trace_mmu &&
+            !mmu_watched(s, BP_WRITE, location)) {
+        mmu_do_write(s, location, value);
+        return;
+    }
+
+    if (s->emu_state->trace_mmu)
+        trace_mem(s->emu_state->trace, s, TRACE_WRITE, location, value);
+
+    bool timed = perf && mmu_is_slow_path(location, 1);
+    if (timed)
+        perf_begin(perf, &timer);
+    mmu_do_write(s, location, value);
+    if (timed)
+        perf_end(perf, PERF_MMU, &timer);
+
+    /* After the write, so conditions see the new value. */
+    mmu_watch(s, BP_WRITE, location, value);
+}
+
 u16 mmu_read16(struct gb_state *s, u16 location) {
     return mmu_read(s, location) | ((u16)mmu_read(s, location + 1) << 8);
 }
@@ -29,5 +29,9 @@ void mmu_write16(struct gb_state *s, u16 location, u16 value);
 u16 mmu_pop16(struct gb_state *s);
 void mmu_push16(struct gb_state *s, u16 value);
 
+/* The bank currently mapped at location: the ROM bank for 4000-7FFF, the WRAM
+ * bank for D000-DFFF, and 0 elsewhere. */
+int mmu_bank(struct gb_state *s, u16 location);
+
 
 #endif
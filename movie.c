@@ -0,0 +1,155 @@
+/*
+ * Movie file format, integers are little-endian:
+ *   header: "GBMV", u32 version, u64 hash of the ROM, u32 anchor size. An
+ *   anchor size of 0 means power-on, otherwise a savestate (as created by
+ *   state_save) of that size follows.
+ *   Then one byte per frame with the buttons applied after that frame, in the
+ *   same order as the joypad register: bit 0-7 are A, B, Select, Start,
+ *   Right, Left, Up, Down.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "movie.h"
+#include "hwdefs.h"
+#include "state.h"
+#include "hash.h"
+
+#define MOVIE_VERSION 1
+
+struct movie {
+    FILE *f;
+    bool playing;
+    unsigned frame;
+    u64 rom_hash;
+    u8 *anchor;
+    size_t anchor_size;
+};
+
+static u64 movie_rom_hash(struct gb_state *s) {
+    return hash_buf(s->mem_ROM, ROM_BANKSIZE * s->mem_num_banks_rom, 0);
+}
+
+static void movie_write_le(FILE *f, u64 value, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        fputc((value >> (i * 8)) & 0xff, f);
+}
+
+static int movie_read_le(FILE *f, u64 *value, int bytes) {
+    u8 buf[8];
+    if (fread(buf, 1, bytes, f) != (size_t)bytes)
+        return 1;
+    *value = 0;
+    for (int i = 0; i < bytes; i++)
+        *value |= (u64)buf[i] << (i * 8);
+    return 0;
+}
+
+struct movie *movie_record(const char *filename, struct gb_state *s,
+        bool from_state) {
+    struct movie *m = calloc(1, sizeof(struct movie));
+    if (!m)
+        return NULL;
+
+    if (from_state && state_save(s, &m->anchor, &m->anchor_size))
+        return NULL;
+
+    m->f = fopen(filename, "wb");
+    if (!m->f) {
+        fprintf(stderr, "Couldn't open %s for writing\n", filename);
+        return NULL;
+    }
+
+    m->rom_hash = movie_rom_hash(s);
+    fwrite("GBMV", 1, 4, m->f);
+    movie_write_le(m->f, MOVIE_VERSION, 4);
+    movie_write_le(m->f, m->rom_hash, 8);
+    movie_write_le(m->f, m->anchor_size, 4);
+    fwrite(m->anchor, 1, m->anchor_size, m->f);
+    return m;
+}
+
+struct movie *movie_play(const char *filename) {
+    struct movie *m = calloc(1, sizeof(struct movie));
+    char magic[4];
+    u64 version, anchor_size;
+
+    if (!m)
+        return NULL;
+    m->playing = 1;
+
+    m->f = fopen(filename, "rb");
+    if (!m->f) {
+        fprintf(stderr, "Couldn't open movie %s\n", filename);
+        return NULL;
+    }
+
+    if (fread(magic, 1, 4, m->f) != 4 || memcmp(magic, "GBMV", 4) ||
+            movie_read_le(m->f, &version, 4) || version != MOVIE_VERSION ||
+            movie_read_le(m->f, &m->rom_hash, 8) ||
+            movie_read_le(m->f, &anchor_size, 4)) {
+        fprintf(stderr, "%s is not a (supported) movie\n", filename);
+        return NULL;
+    }
+
+    if (anchor_size) {
+        m->anchor_size = anchor_size;
+        m->anchor = malloc(anchor_size);
+        if (!m->anchor ||
+                fread(m->anchor, 1, anchor_size, m->f) != anchor_size) {
+            fprintf(stderr, "Couldn't read savestate of movie %s\n", filename);
+            return NULL;
+        }
+    }
+    return m;
+}
+
+void movie_anchor(struct movie *m, u8 **state_buf, size_t *state_buf_size) {
+    *state_buf = m->anchor;
+    *state_buf_size = m->anchor_size;
+}
+
+int movie_check_rom(struct movie *m, struct gb_state *s) {
+    if (movie_rom_hash(s) == m->rom_hash)
+        return 0;
+    fprintf(stderr, "Movie was recorded with a different ROM\n");
+    return 1;
+}
+
+int movie_input(struct movie *m, struct player_input *input) {
+    if (m->playing) {
+        int buttons = fgetc(m->f);
+        if (buttons == EOF)
+            return 1;
+
+        input->button_a      = buttons & (1 << 0);
+        input->button_b      = buttons & (1 << 1);
+        input->button_select = buttons & (1 << 2);
+        input->button_start  = buttons & (1 << 3);
+        input->button_right  = buttons & (1 << 4);
+        input->button_left   = buttons & (1 << 5);
+        input->button_up     = buttons & (1 << 6);
+        input->button_down   = buttons & (1 << 7);
+    } else {
+        fputc(input->button_a      << 0 |
+              input->button_b      << 1 |
+              input->button_select << 2 |
+              input->button_start  << 3 |
+              input->button_right  << 4 |
+              input->button_left   << 5 |
+              input->button_up     << 6 |
+              input->button_down   << 7, m->f);
+    }
+    m->frame++;
+    return 0;
+}
+
+void movie_close(struct movie *m) {
+    printf("Movie %s %u frames.\n", m->playing ? "played" : "recorded",
+            m->frame);
+    fclose(m->f);
+    free(m->anchor);
+    free(m);
+}
@@ -0,0 +1,37 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include "types.h"
+#include "player_input.h"
+
+/*
+ * Input movies: the buttons pressed during every frame, starting from a fixed
+ * point (anchor), so a run can be replayed exactly. The anchor is either
+ * power-on (the ROM without battery-backed RAM) or an embedded savestate.
+ */
+struct movie;
+
+/* Start recording after emu_init. With from_state, the current state is
+ * stored as anchor, otherwise the emulator must have just powered on (without
+ * loading battery-backed RAM). Returns NULL on failure. */
+struct movie *movie_record(const char *filename, struct gb_state *s,
+        bool from_state);
+
+/* Open a movie for playback, to be called before emu_init. Returns NULL on
+ * failure. */
+struct movie *movie_play(const char *filename);
+
+/* The savestate to start playback from (via emu_args), NULL for power-on. */
+void movie_anchor(struct movie *m, u8 **state_buf, size_t *state_buf_size);
+
+/* Check whether the loaded ROM is the one the movie was recorded with. */
+int movie_check_rom(struct movie *m, struct gb_state *s);
+
+/* Call once per frame, before emu_process_inputs. When recording this stores
+ * the buttons of input, during playback it replaces them by the recorded
+ * ones. Returns 1 when playback has reached the end of the movie. */
+int movie_input(struct movie *m, struct player_input *input);
+
+void movie_close(struct movie *m);
+
+#endif
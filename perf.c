@@ -0,0 +1,104 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "perf.h"
+
+#define PERF_HISTORY_FRAMES 3600
+
+struct perf {
+    atomic_uint_fast64_t frame_ticks[PERF_NUM_COUNTERS]; /* Current frame. */
+    u64 history[PERF_NUM_COUNTERS][PERF_HISTORY_FRAMES];
+    unsigned frames; /* Completed frames. */
+    bool started;
+
+    /* To convert ticks to seconds. */
+    u64 start_ticks;
+    double start_time;
+};
+
+_Thread_local u64 perf_child_ticks;
+
+static double perf_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#if !defined(__x86_64__) && !defined(__i386__)
+u64 perf_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+struct perf *perf_new(void) {
+    struct perf *p = calloc(1, sizeof(struct perf));
+    if (!p)
+        return NULL;
+    p->start_ticks = perf_now();
+    p->start_time = perf_time();
+    return p;
+}
+
+const char *perf_counter_name(enum perf_counter c) {
+    static const char *names[PERF_NUM_COUNTERS] = {
+        [PERF_CPU] = "cpu",
+        [PERF_MMU] = "mmu",
+        [PERF_LCD] = "lcd",
+        [PERF_AUDIO] = "audio",
+        [PERF_FRONTEND] = "frontend",
+        [PERF_STATE] = "state",
+    };
+    return names[c];
+}
+
+void perf_frame(struct perf *p) {
+    /* The time before the first frame (initialization) isn't a frame, but
+     * what was measured then (loading state) is counted in the first one. */
+    if (p->started) {
+        unsigned i = p->frames % PERF_HISTORY_FRAMES;
+        for (int c = 0; c < PERF_NUM_COUNTERS; c++)
+            p->history[c][i] = atomic_exchange_explicit(&p->frame_ticks[c], 0,
+                    memory_order_relaxed);
+        p->frames++;
+    } else
+        p->started = 1;
+}
+
+void perf_add(struct perf *p, enum perf_counter c, u64 ticks) {
+    atomic_fetch_add_explicit(&p->frame_ticks[c], ticks, memory_order_relaxed);
+}
+
+static int perf_cmp(const void *a, const void *b) {
+    u64 ta = *(const u64 *)a, tb = *(const u64 *)b;
+    return (ta > tb) - (ta < tb);
+}
+
+void perf_stats(struct perf *p, enum perf_counter c, struct perf_stats *stats) {
+    u64 sorted[PERF_HISTORY_FRAMES];
+    unsigned n = p->frames < PERF_HISTORY_FRAMES ? p->frames
+                                                 : PERF_HISTORY_FRAMES;
+
+    memset(stats, 0, sizeof(struct perf_stats));
+    stats->frames = n;
+    if (!n)
+        return;
+
+    double elapsed_ticks = perf_now() - p->start_ticks;
+    double us_per_tick = elapsed_ticks ?
+        (perf_time() - p->start_time) * 1e6 / elapsed_ticks : 0;
+
+    memcpy(sorted, p->history[c], n * sizeof(u64));
+    qsort(sorted, n, sizeof(u64), perf_cmp);
+
+    double sum = 0;
+    for (unsigned i = 0; i < n; i++)
+        sum += sorted[i];
+    stats->min = sorted[0] * us_per_tick;
+    stats->avg = sum / n * us_per_tick;
+    stats->p99 = sorted[(n * 99 + 99) / 100 - 1] * us_per_tick;
+}
@@ -0,0 +1,74 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include "types.h"
+
+/*
+ * Host time measurement per part of the emulator, accumulated per frame. Each
+ * counter only gets the time not spent in other (nested) measured parts, so
+ * PERF_CPU is everything emulated on the main thread that isn't covered by
+ * one of the others. LCD rendering on the render thread is counted as well.
+ */
+enum perf_counter {
+    PERF_CPU,      /* CPU, timers and the rest of emu_step. */
+    PERF_MMU,      /* Slow memory paths: MBC registers and I/O ports. */
+    PERF_LCD,      /* Rendering lines (and waiting for the render thread). */
+    PERF_AUDIO,    /* APU catch-up and resampling. */
+    PERF_FRONTEND, /* Converting/presenting frames in the frontend. */
+    PERF_STATE,    /* Saving and loading state. */
+    PERF_NUM_COUNTERS
+};
+
+/* In microseconds per frame, over the last PERF_HISTORY_FRAMES frames. */
+struct perf_stats {
+    unsigned frames;
+    double min, avg, p99;
+};
+
+struct perf;
+
+struct perf_timer {
+    u64 start;
+    u64 outer_child_ticks;
+};
+
+/* Ticks spent in measured parts nested in the current one (per thread). */
+extern _Thread_local u64 perf_child_ticks;
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline u64 perf_now(void) {
+    return __rdtsc();
+}
+#else
+u64 perf_now(void);
+#endif
+
+struct perf *perf_new(void);
+const char *perf_counter_name(enum perf_counter c);
+
+/* Start a new frame: the time measured since the last call is one frame. */
+void perf_frame(struct perf *p);
+void perf_add(struct perf *p, enum perf_counter c, u64 ticks);
+void perf_stats(struct perf *p, enum perf_counter c, struct perf_stats *stats);
+
+/* Measure a part of the emulator. Does nothing if p is NULL (disabled). */
+static inline void perf_begin(struct perf *p, struct perf_timer *t) {
+    *t = (struct perf_timer){0}; /* Callers may pass p again from memory. */
+    if (!p)
+        return;
+    t->outer_child_ticks = perf_child_ticks;
+    perf_child_ticks = 0;
+    t->start = perf_now();
+}
+
+static inline void perf_end(struct perf *p, enum perf_counter c,
+        struct perf_timer *t) {
+    if (!p)
+        return;
+    u64 total = perf_now() - t->start;
+    perf_add(p, c, total - perf_child_ticks);
+    perf_child_ticks = t->outer_child_ticks + total;
+}
+
+#endif
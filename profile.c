@@ -0,0 +1,308 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "profile.h"
+#include "mmu.h"
+#include "cpu.h"
+#include "disassembler.h"
+
+#define PROFILE_TABLE_BITS 12 /* Initial size, grows when half full. */
+#define PROFILE_MAX_DEPTH 64
+#define PROFILE_ROOT_KEY 0x0100 /* Code not called from anywhere (main). */
+
+/* Code location: bank (see mmu_bank) << 16 | pc. */
+typedef u32 profile_key;
+#define PROFILE_KEY_NONE 0xffffffff /* Unused table entry. */
+
+struct profile_entry {
+    profile_key key;
+    u32 count;
+    u64 cycles;
+};
+
+struct profile_table {
+    struct profile_entry *entries;
+    int bits;
+    u32 used;
+};
+
+/* Node in the tree of call stacks, identified by the function (call target)
+ * and its caller. */
+struct profile_node {
+    profile_key key;
+    int parent, child, sibling; /* Indices, or -1. */
+    u64 cycles; /* Self, excluding callees and halted. */
+    u64 halt_cycles;
+};
+
+struct profile {
+    struct profile_table insns;
+
+    struct profile_node *nodes;
+    int num_nodes, max_nodes;
+    int cur; /* Node of current call stack. */
+    int depth;
+    int overflow; /* Calls deeper than PROFILE_MAX_DEPTH. */
+
+    u64 total_cycles;
+    u64 halt_cycles;
+
+    /* Instruction being executed by this step. */
+    profile_key step_key;
+    u16 step_sp;
+    u8 step_op;
+    bool step_halted;
+};
+
+static int profile_table_init(struct profile_table *t, int bits) {
+    t->entries = calloc(1 << bits, sizeof(struct profile_entry));
+    t->bits = bits;
+    t->used = 0;
+    if (!t->entries)
+        return 1;
+    for (int i = 0; i < 1 << bits; i++)
+        t->entries[i].key = PROFILE_KEY_NONE;
+    return 0;
+}
+
+static struct profile_entry *profile_table_get(struct profile_table *t,
+        profile_key key) {
+    u32 mask = (1 << t->bits) - 1;
+    u32 i = (key * 0x9e3779b1u) >> (32 - t->bits);
+
+    while (t->entries[i].key != PROFILE_KEY_NONE && t->entries[i].key != key)
+        i = (i + 1) & mask;
+    if (t->entries[i].key == key)
+        return &t->entries[i];
+
+    if (t->used + 1 > mask / 2) {
+        struct profile_table old = *t;
+        if (profile_table_init(t, old.bits + 1)) {
+            *t = old;
+            return NULL;
+        }
+        for (u32 j = 0; j <= mask; j++)
+            if (old.entries[j].key != PROFILE_KEY_NONE)
+                *profile_table_get(t, old.entries[j].key) = old.entries[j];
+        free(old.entries);
+        return profile_table_get(t, key);
+    }
+
+    t->used++;
+    t->entries[i].key = key;
+    return &t->entries[i];
+}
+
+static int profile_node_new(struct profile *p, profile_key key, int parent) {
+    if (p->num_nodes == p->max_nodes) {
+        int max_nodes = p->max_nodes ? p->max_nodes * 2 : 256;
+        struct profile_node *nodes = realloc(p->nodes,
+                max_nodes * sizeof(struct profile_node));
+        if (!nodes)
+            return -1;
+        p->nodes = nodes;
+        p->max_nodes = max_nodes;
+    }
+
+    struct profile_node *n = &p->nodes[p->num_nodes];
+    n->key = key;
+    n->parent = parent;
+    n->child = -1;
+    n->sibling = -1;
+    n->cycles = 0;
+    n->halt_cycles = 0;
+    if (parent >= 0) {
+        n->sibling = p->nodes[parent].child;
+        p->nodes[parent].child = p->num_nodes;
+    }
+    return p->num_nodes++;
+}
+
+struct profile *profile_new(void) {
+    struct profile *p = calloc(1, sizeof(struct profile));
+    if (!p)
+        return NULL;
+    if (profile_table_init(&p->insns, PROFILE_TABLE_BITS))
+        return NULL;
+    if (profile_node_new(p, PROFILE_ROOT_KEY, -1) < 0)
+        return NULL;
+    return p;
+}
+
+static profile_key profile_key_of(struct gb_state *s, u16 pc) {
+    return (u32)mmu_bank(s, pc) << 16 | pc;
+}
+
+static void profile_enter(struct profile *p, profile_key key) {
+    if (p->depth == PROFILE_MAX_DEPTH) {
+        p->overflow++;
+        return;
+    }
+
+    int n = p->nodes[p->cur].child;
+    while (n >= 0 && p->nodes[n].key != key)
+        n = p->nodes[n].sibling;
+    if (n < 0 && (n = profile_node_new(p, key, p->cur)) < 0)
+        return;
+    p->cur = n;
+    p->depth++;
+}
+
+static void profile_leave(struct profile *p) {
+    if (p->overflow)
+        p->overflow--;
+    else if (p->depth) {
+        p->cur = p->nodes[p->cur].parent;
+        p->depth--;
+    }
+}
+
+void profile_pre_step(struct profile *p, struct gb_state *s) {
+    u16 vector = cpu_next_interrupt(s);
+    u16 pc = s->pc;
+
+    p->step_sp = s->sp;
+    p->step_halted = !cpu_executes(s);
+    if (vector) {
+        /* cpu_step dispatches the interrupt, and then executes the first
+         * instruction of the handler. */
+        pc = vector;
+        p->step_sp -= 2;
+        profile_enter(p, profile_key_of(s, pc));
+    }
+    p->step_key = profile_key_of(s, pc);
+    p->step_op = mmu_read(s, pc);
+}
+
+void profile_post_step(struct profile *p, struct gb_state *s) {
+    u32 cycles = s->emu_state->last_op_cycles;
+    u8 op = p->step_op;
+
+    p->total_cycles += cycles;
+    if (p->step_halted) {
+        p->halt_cycles += cycles;
+        p->nodes[p->cur].halt_cycles += cycles;
+        return;
+    }
+
+    struct profile_entry *e = profile_table_get(&p->insns, p->step_key);
+    if (e) {
+        e->count++;
+        e->cycles += cycles;
+    }
+    p->nodes[p->cur].cycles += cycles;
+
+    /* Conditional calls and returns are only taken if they moved SP. */
+    if (op == 0xcd || (op & 0xe7) == 0xc4 || (op & 0xc7) == 0xc7) {
+        if (s->sp == (u16)(p->step_sp - 2))
+            profile_enter(p, profile_key_of(s, s->pc));
+    } else if (op == 0xc9 || op == 0xd9 || (op & 0xe7) == 0xc0) {
+        if (s->sp == (u16)(p->step_sp + 2))
+            profile_leave(p);
+    }
+}
+
+static int profile_entry_cmp(const void *a, const void *b) {
+    const struct profile_entry *ea = a, *eb = b;
+    return (ea->cycles < eb->cycles) - (ea->cycles > eb->cycles);
+}
+
+/* Used entries of t, sorted by cycles (descending). */
+static struct profile_entry *profile_sorted(struct profile_table *t) {
+    struct profile_entry *sorted = malloc(t->used * sizeof(*sorted));
+    if (!sorted)
+        return NULL;
+    for (u32 i = 0, n = 0; i < 1u << t->bits; i++)
+        if (t->entries[i].key != PROFILE_KEY_NONE)
+            sorted[n++] = t->entries[i];
+    qsort(sorted, t->used, sizeof(*sorted), profile_entry_cmp);
+    return sorted;
+}
+
+/* Disassemble the instruction at key, with its bank mapped in temporarily. */
+static void profile_disassemble(struct gb_state *s, profile_key key) {
+    int bank_rom = s->mem_bank_rom, bank_wram = s->mem_bank_wram;
+    u8 romram_select = s->mem_mbc1_romram_select;
+    u16 pc = key & 0xffff;
+
+    if (pc >= 0x4000 && pc < 0x8000) {
+        s->mem_bank_rom = key >> 16;
+        s->mem_mbc1_romram_select = 1;
+    } else if (pc >= 0xd000 && pc < 0xe000)
+        s->mem_bank_wram = key >> 16;
+
+    disassemble_pc(s, pc);
+
+    s->mem_bank_rom = bank_rom;
+    s->mem_bank_wram = bank_wram;
+    s->mem_mbc1_romram_select = romram_select;
+}
+
+void profile_report(struct profile *p, struct gb_state *s, unsigned top) {
+    struct profile_table funcs;
+    struct profile_entry *sorted;
+    double total = p->total_cycles ? p->total_cycles : 1;
+
+    printf("Profile: %llu cycles, %.2f%% halted\n",
+            (unsigned long long)p->total_cycles, 100 * p->halt_cycles / total);
+
+    /* Functions: self cycles of all call stacks ending in them. */
+    if (profile_table_init(&funcs, PROFILE_TABLE_BITS))
+        return;
+    for (int i = 0; i < p->num_nodes; i++) {
+        struct profile_entry *e = profile_table_get(&funcs, p->nodes[i].key);
+        if (e)
+            e->cycles += p->nodes[i].cycles;
+    }
+    if ((sorted = profile_sorted(&funcs))) {
+        printf("Hottest functions (self cycles, entry):\n");
+        for (u32 i = 0; i < top && i < funcs.used && sorted[i].cycles; i++) {
+            printf("  %6.2f%% %12llu  ", 100 * sorted[i].cycles / total,
+                    (unsigned long long)sorted[i].cycles);
+            profile_disassemble(s, sorted[i].key);
+        }
+        free(sorted);
+    }
+    free(funcs.entries);
+
+    if ((sorted = profile_sorted(&p->insns))) {
+        printf("Hottest instructions (cycles, executions):\n");
+        for (u32 i = 0; i < top && i < p->insns.used; i++) {
+            printf("  %6.2f%% %12llu %10u  ", 100 * sorted[i].cycles / total,
+                    (unsigned long long)sorted[i].cycles, sorted[i].count);
+            profile_disassemble(s, sorted[i].key);
+        }
+        free(sorted);
+    }
+}
+
+static void profile_write_stack(struct profile *p, FILE *f, int n) {
+    if (p->nodes[n].parent >= 0) {
+        profile_write_stack(p, f, p->nodes[n].parent);
+        fputc(';', f);
+    }
+    fprintf(f, "%02x:%04x", p->nodes[n].key >> 16, p->nodes[n].key & 0xffff);
+}
+
+int profile_write_folded(struct profile *p, const char *filename) {
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        fprintf(stderr, "Couldn't open %s for writing\n", filename);
+        return 1;
+    }
+
+    for (int i = 0; i < p->num_nodes; i++) {
+        if (p->nodes[i].cycles) {
+            profile_write_stack(p, f, i);
+            fprintf(f, " %llu\n", (unsigned long long)p->nodes[i].cycles);
+        }
+        if (p->nodes[i].halt_cycles) {
+            profile_write_stack(p, f, i);
+            fprintf(f, ";halt %llu\n",
+                    (unsigned long long)p->nodes[i].halt_cycles);
+        }
+    }
+    fclose(f);
+    return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "types.h"
+
+/*
+ * Guest code profiler: counts executed instructions and cycles per (bank, PC),
+ * and per call stack by tracking CALL/RST/interrupts and RET/RETI. The stacks
+ * can be written in the folded format used by flamegraph tools.
+ */
+struct profile;
+
+struct profile *profile_new(void);
+
+/* Call around every emu_step. */
+void profile_pre_step(struct profile *p, struct gb_state *s);
+void profile_post_step(struct profile *p, struct gb_state *s);
+
+/* Print the hottest functions and instructions (with their disassembly). */
+void profile_report(struct profile *p, struct gb_state *s, unsigned top);
+
+/* Write "frame;frame;frame cycles" lines, one per unique call stack. */
+int profile_write_folded(struct profile *p, const char *filename);
+
+#endif
@@ -0,0 +1,243 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "record.h"
+#include "hwdefs.h"
+#include "audio.h"
+
+#define RECORD_QUEUE_SIZE 64 /* Frames, must be a power of two. */
+#define RECORD_PIXELS (160 * 144)
+#define RECORD_FPS_DEN 100000
+
+/* A queued frame. The conversion to YUV is left to the writer thread, so the
+ * emulator only has to copy the frame. */
+struct record_slot {
+    bool use_colors;
+    u16 pixbuf[RECORD_PIXELS];
+    s16 *samples;
+    int num_samples;
+};
+
+/*
+ * The emulator (producer) and writer thread (consumer) share a
+ * single-producer single-consumer ring of frames. Only when the ring is full
+ * (i.e., the disk has been slower than the emulator for over a second) does
+ * the emulator wait, so no frames are ever dropped.
+ */
+struct recorder {
+    FILE *video;
+    FILE *audio;
+    long video_fps_pos; /* Offset of the frame rate in the Y4M header. */
+
+    pthread_t thread;
+    struct record_slot *slots;
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_bool quit;
+
+    unsigned frames;
+    double duration;
+    unsigned stalls; /* Frames for which the emulator waited for the disk. */
+    size_t audio_bytes;
+
+    u8 yuv[3][RECORD_PIXELS]; /* Writer thread only. */
+};
+
+/* Wait a little while for the other thread to make progress. */
+static void record_backoff(int *spins) {
+    if ((*spins)++ < 64) {
+        sched_yield();
+    } else {
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void record_write_le(FILE *f, u32 value, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        fputc((value >> (i * 8)) & 0xff, f);
+}
+
+/* The WAV header, the sizes are filled in properly by record_close. */
+static void record_wav_header(FILE *f, int sample_rate, u32 data_size) {
+    int block_align = AUDIO_CHANNELS * sizeof(s16);
+
+    fwrite("RIFF", 1, 4, f);
+    record_write_le(f, 36 + data_size, 4);
+    fwrite("WAVEfmt ", 1, 8, f);
+    record_write_le(f, 16, 4); /* fmt chunk size */
+    record_write_le(f, 1, 2); /* PCM */
+    record_write_le(f, AUDIO_CHANNELS, 2);
+    record_write_le(f, sample_rate, 4);
+    record_write_le(f, sample_rate * block_align, 4);
+    record_write_le(f, block_align, 2);
+    record_write_le(f, 16, 2); /* Bits per sample */
+    fwrite("data", 1, 4, f);
+    record_write_le(f, data_size, 4);
+}
+
+/* Convert the frame to (limited range, BT.601) YUV 4:4:4, like the SDL
+ * frontend shows it. */
+static void record_convert(struct recorder *r, struct record_slot *slot) {
+    static const u8 dmg_shades[] = { 0xff, 0xaa, 0x66, 0x11 };
+
+    for (int i = 0; i < RECORD_PIXELS; i++) {
+        int red, green, blue;
+        if (slot->use_colors) {
+            u16 col = slot->pixbuf[i];
+            red = ((col >> 0) & 0x1f) << 3;
+            green = ((col >> 5) & 0x1f) << 3;
+            blue = ((col >> 10) & 0x1f) << 3;
+        } else {
+            red = green = blue = dmg_shades[slot->pixbuf[i] & 3];
+        }
+        r->yuv[0][i] = ((66 * red + 129 * green + 25 * blue + 128) >> 8) + 16;
+        r->yuv[1][i] = ((-38 * red - 74 * green + 112 * blue + 128) >> 8) + 128;
+        r->yuv[2][i] = ((112 * red - 94 * green - 18 * blue + 128) >> 8) + 128;
+    }
+}
+
+static void *record_thread(void *arg) {
+    struct recorder *r = arg;
+    size_t tail = 0;
+    int spins = 0;
+
+    while (1) {
+        size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (tail == head) {
+            if (atomic_load_explicit(&r->quit, memory_order_acquire) &&
+                    tail == atomic_load_explicit(&r->head,
+                        memory_order_acquire))
+                return NULL;
+            record_backoff(&spins);
+            continue;
+        }
+        spins = 0;
+
+        for (; tail != head; tail++) {
+            struct record_slot *slot =
+                &r->slots[tail & (RECORD_QUEUE_SIZE - 1)];
+            record_convert(r, slot);
+            fputs("FRAME\n", r->video);
+            fwrite(r->yuv, 1, sizeof(r->yuv), r->video);
+            if (r->audio)
+                fwrite(slot->samples, AUDIO_CHANNELS * sizeof(s16),
+                        slot->num_samples, r->audio);
+            atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+        }
+    }
+}
+
+static FILE *record_fopen(const char *basename, const char *ext) {
+    size_t len = strlen(basename) + strlen(ext) + 1;
+    char *filename = malloc(len);
+    if (!filename)
+        return NULL;
+    snprintf(filename, len, "%s%s", basename, ext);
+
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+        fprintf(stderr, "Couldn't open %s for recording\n", filename);
+    free(filename);
+    return f;
+}
+
+/* Failures are fatal for the frontend, so nothing is cleaned up on errors. */
+struct recorder *record_open(const char *basename, int sample_rate) {
+    struct recorder *r = calloc(1, sizeof(struct recorder));
+    if (!r)
+        return NULL;
+
+    r->slots = calloc(RECORD_QUEUE_SIZE, sizeof(struct record_slot));
+    if (!r->slots)
+        return NULL;
+    for (int i = 0; i < RECORD_QUEUE_SIZE; i++) {
+        r->slots[i].samples = calloc(AUDIO_BUF_SIZE * AUDIO_CHANNELS,
+                sizeof(s16));
+        if (!r->slots[i].samples)
+            return NULL;
+    }
+
+    r->video = record_fopen(basename, ".y4m");
+    if (!r->video)
+        return NULL;
+    if (sample_rate) {
+        r->audio = record_fopen(basename, ".wav");
+        if (!r->audio)
+            return NULL;
+        record_wav_header(r->audio, sample_rate, 0);
+    }
+
+    /* The frame rate is written with a fixed width, so record_close can
+     * replace it by the actual (average) rate of the emulated frames. */
+    fprintf(r->video, "YUV4MPEG2 W%d H%d F", GB_LCD_WIDTH, GB_LCD_HEIGHT);
+    r->video_fps_pos = ftell(r->video);
+    fprintf(r->video, "%09u:%u Ip A1:1 C444\n",
+            (unsigned)(1. * GB_FREQ / GB_LCD_FRAME_CLKS * RECORD_FPS_DEN),
+            RECORD_FPS_DEN);
+
+    if (pthread_create(&r->thread, NULL, record_thread, r))
+        return NULL;
+    return r;
+}
+
+void record_frame(struct recorder *r, bool use_colors, const u16 *pixbuf,
+        const s16 *samples, int num_samples, double duration) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    int spins = 0;
+
+    if (head - atomic_load_explicit(&r->tail, memory_order_acquire) ==
+            RECORD_QUEUE_SIZE) {
+        r->stalls++;
+        while (head - atomic_load_explicit(&r->tail, memory_order_acquire) ==
+                RECORD_QUEUE_SIZE)
+            record_backoff(&spins);
+    }
+
+    struct record_slot *slot = &r->slots[head & (RECORD_QUEUE_SIZE - 1)];
+    slot->use_colors = use_colors;
+    memcpy(slot->pixbuf, pixbuf, sizeof(slot->pixbuf));
+    if (num_samples > AUDIO_BUF_SIZE)
+        num_samples = AUDIO_BUF_SIZE;
+    memcpy(slot->samples, samples, num_samples * AUDIO_CHANNELS * sizeof(s16));
+    slot->num_samples = num_samples;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+
+    r->frames++;
+    r->duration += duration;
+    r->audio_bytes += num_samples * AUDIO_CHANNELS * sizeof(s16);
+}
+
+void record_close(struct recorder *r) {
+    atomic_store_explicit(&r->quit, 1, memory_order_release);
+    pthread_join(r->thread, NULL);
+
+    if (r->frames && r->duration > 0) {
+        fseek(r->video, r->video_fps_pos, SEEK_SET);
+        fprintf(r->video, "%09u",
+                (unsigned)(r->frames / r->duration * RECORD_FPS_DEN + .5));
+    }
+    fclose(r->video);
+
+    if (r->audio) {
+        fseek(r->audio, 4, SEEK_SET);
+        record_write_le(r->audio, 36 + r->audio_bytes, 4);
+        fseek(r->audio, 40, SEEK_SET);
+        record_write_le(r->audio, r->audio_bytes, 4);
+        fclose(r->audio);
+    }
+
+    printf("Recorded %u frames (waited for the disk %u times).\n", r->frames,
+            r->stalls);
+
+    for (int i = 0; i < RECORD_QUEUE_SIZE; i++)
+        free(r->slots[i].samples);
+    free(r->slots);
+    free(r);
+}
@@ -0,0 +1,26 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include "types.h"
+
+/*
+ * Recording of the emulator output to disk: video as uncompressed YUV4MPEG2
+ * (basename.y4m), audio as 16-bit stereo PCM (basename.wav). The frames are
+ * queued and written by a separate thread, so the emulator does not have to
+ * wait for the disk (unless it can't keep up at all).
+ */
+struct recorder;
+
+/* Start recording to basename.y4m and (if sample_rate is not 0) basename.wav.
+ * Returns NULL on failure. */
+struct recorder *record_open(const char *basename, int sample_rate);
+
+/* Queue one frame: the contents of lcd_pixbuf, the audio samples generated
+ * during the frame, and the emulated duration of the frame in seconds. */
+void record_frame(struct recorder *r, bool use_colors, const u16 *pixbuf,
+        const s16 *samples, int num_samples, double duration);
+
+/* Write out all queued frames, finish the files and free the recorder. */
+void record_close(struct recorder *r);
+
+#endif
@@ -0,0 +1,274 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "reverse.h"
+#include "hwdefs.h"
+#include "emu.h"
+#include "cpu.h"
+#include "audio.h"
+#include "lcd.h"
+#include "breakpoint.h"
+#include "perf.h"
+
+#define REVERSE_NONE ((u64)-1)
+
+enum reverse_mode {
+    REVERSE_STEP,
+    REVERSE_CONTINUE,
+};
+
+struct reverse_snapshot {
+    u64 step; /* time_steps when taken. */
+    struct gb_state gb; /* The pointers in it are the same for every run. */
+    u8 *mem; /* WRAM, VRAM and cartridge RAM. */
+
+    /* Emulator state that affects emulation. */
+    u32 audio_cycles;
+    u32 last_op_cycles;
+    u32 time_cycles;
+    u32 time_seconds;
+    u64 time_instructions;
+};
+
+/* Buttons (io_buttons_buttons and io_buttons_dirs) from a step onwards. */
+struct reverse_input {
+    u64 step;
+    u8 buttons, dirs;
+};
+
+struct reverse {
+    unsigned interval;
+    unsigned frames;
+
+    struct reverse_snapshot snaps[REVERSE_MAX_SNAPSHOTS]; /* Ring. */
+    int first, num;
+
+    struct reverse_input *inputs;
+    size_t num_inputs, max_inputs;
+};
+
+struct reverse *reverse_new(unsigned interval) {
+    struct reverse *r = calloc(1, sizeof(struct reverse));
+    if (!r)
+        return NULL;
+    r->interval = interval;
+    return r;
+}
+
+static struct reverse_snapshot *reverse_snap(struct reverse *r, int i) {
+    return &r->snaps[(r->first + i) % REVERSE_MAX_SNAPSHOTS];
+}
+
+static void reverse_mem_sizes(struct gb_state *s, size_t sizes[3]) {
+    sizes[0] = WRAM_BANKSIZE * s->mem_num_banks_wram;
+    sizes[1] = VRAM_BANKSIZE * s->mem_num_banks_vram;
+    sizes[2] = s->mem_EXTRAM ? EXTRAM_BANKSIZE * s->mem_num_banks_extram : 0;
+}
+
+void reverse_frame(struct reverse *r, struct gb_state *s) {
+    struct emu_state *es = s->emu_state;
+    size_t sizes[3];
+
+    if (r->frames++ % r->interval)
+        return;
+    if (r->num && reverse_snap(r, r->num - 1)->step == es->time_steps)
+        return;
+
+    struct reverse_snapshot *snap;
+    if (r->num == REVERSE_MAX_SNAPSHOTS) {
+        snap = reverse_snap(r, 0);
+        r->first = (r->first + 1) % REVERSE_MAX_SNAPSHOTS;
+
+        /* Forget the inputs from before the (new) oldest snapshot. */
+        u64 oldest = reverse_snap(r, 0)->step;
+        size_t i = 0;
+        while (i + 1 < r->num_inputs && r->inputs[i + 1].step <= oldest)
+            i++;
+        memmove(r->inputs, r->inputs + i,
+                (r->num_inputs - i) * sizeof(struct reverse_input));
+        r->num_inputs -= i;
+    } else
+        snap = reverse_snap(r, r->num++);
+
+    reverse_mem_sizes(s, sizes);
+    if (!snap->mem && !(snap->mem = malloc(sizes[0] + sizes[1] + sizes[2]))) {
+        r->num--;
+        return;
+    }
+    memcpy(snap->mem, s->mem_WRAM, sizes[0]);
+    memcpy(snap->mem + sizes[0], s->mem_VRAM, sizes[1]);
+    if (sizes[2])
+        memcpy(snap->mem + sizes[0] + sizes[1], s->mem_EXTRAM, sizes[2]);
+
+    snap->step = es->time_steps;
+    snap->gb = *s;
+    snap->audio_cycles = es->audio_cycles;
+    snap->last_op_cycles = es->last_op_cycles;
+    snap->time_cycles = es->time_cycles;
+    snap->time_seconds = es->time_seconds;
+    snap->time_instructions = es->time_instructions;
+}
+
+void reverse_input(struct reverse *r, struct gb_state *s) {
+    struct reverse_input *last = r->num_inputs ?
+        &r->inputs[r->num_inputs - 1] : NULL;
+
+    if (last && last->buttons == s->io_buttons_buttons &&
+            last->dirs == s->io_buttons_dirs)
+        return;
+
+    if (r->num_inputs == r->max_inputs) {
+        size_t max = r->max_inputs ? r->max_inputs * 2 : 1024;
+        struct reverse_input *inputs = realloc(r->inputs,
+                max * sizeof(struct reverse_input));
+        if (!inputs)
+            return;
+        r->inputs = inputs;
+        r->max_inputs = max;
+    }
+    r->inputs[r->num_inputs++] = (struct reverse_input) {
+        .step = s->emu_state->time_steps,
+        .buttons = s->io_buttons_buttons,
+        .dirs = s->io_buttons_dirs,
+    };
+}
+
+/* Restore a snapshot. Returns the first input to replay after it. */
+static size_t reverse_restore(struct reverse *r, struct gb_state *s,
+        struct reverse_snapshot *snap) {
+    struct emu_state *es = s->emu_state;
+    struct perf_timer timer;
+    size_t sizes[3];
+
+    perf_begin(es->perf, &timer);
+    *s = snap->gb;
+    reverse_mem_sizes(s, sizes);
+    memcpy(s->mem_WRAM, snap->mem, sizes[0]);
+    memcpy(s->mem_VRAM, snap->mem + sizes[0], sizes[1]);
+    if (sizes[2])
+        memcpy(s->mem_EXTRAM, snap->mem + sizes[0] + sizes[1], sizes[2]);
+    lcd_resync(s);
+    perf_end(es->perf, PERF_STATE, &timer);
+
+    es->time_steps = snap->step;
+    es->audio_cycles = snap->audio_cycles;
+    es->last_op_cycles = snap->last_op_cycles;
+    es->time_cycles = snap->time_cycles;
+    es->time_seconds = snap->time_seconds;
+    es->time_instructions = snap->time_instructions;
+
+    size_t input = 0;
+    while (input < r->num_inputs && r->inputs[input].step < snap->step)
+        input++;
+    return input;
+}
+
+static void reverse_replay_step(struct reverse *r, struct gb_state *s,
+        size_t *input) {
+    struct emu_state *es = s->emu_state;
+
+    if (*input < r->num_inputs && r->inputs[*input].step == es->time_steps) {
+        s->io_buttons_buttons = r->inputs[*input].buttons;
+        s->io_buttons_dirs = r->inputs[*input].dirs;
+        (*input)++;
+    }
+
+    emu_step_replay(s);
+
+    /* Keep the audio synthesis from overflowing, without output. */
+    if (es->lcd_entered_vblank) {
+        audio_end_frame(s);
+        es->audio_buf_len = 0;
+    }
+}
+
+/* Replay from a snapshot up to (not including) step end, returning the last
+ * step to stop at, or REVERSE_NONE. */
+static u64 reverse_scan(struct reverse *r, struct gb_state *s,
+        struct reverse_snapshot *snap, u64 end, enum reverse_mode mode) {
+    struct emu_state *es = s->emu_state;
+    struct breakpoints *bps = es->breakpoints;
+    size_t input = reverse_restore(r, s, snap);
+    u64 found = REVERSE_NONE;
+
+    while (es->time_steps < end) {
+        if (mode == REVERSE_STEP) {
+            if (cpu_executes(s))
+                found = es->time_steps;
+        } else {
+            u16 pc = bp_exec_pc(bps, s);
+            if (bp_exec_marked(bps, pc) && bp_check_exec(bps, s, pc))
+                found = es->time_steps;
+        }
+
+        reverse_replay_step(r, s, &input);
+
+        /* Watchpoints break after the instruction that triggered them. */
+        if (es->dbg_break_next) {
+            es->dbg_break_next = 0;
+            if (es->time_steps < end)
+                found = es->time_steps;
+        }
+    }
+    return found;
+}
+
+/* Discard the history after the current point, as it may now change. */
+static void reverse_truncate(struct reverse *r, struct gb_state *s) {
+    u64 step = s->emu_state->time_steps;
+
+    while (r->num && reverse_snap(r, r->num - 1)->step > step)
+        r->num--;
+    while (r->num_inputs && r->inputs[r->num_inputs - 1].step > step)
+        r->num_inputs--;
+}
+
+static int reverse_go(struct reverse *r, struct gb_state *s,
+        enum reverse_mode mode) {
+    struct emu_state *es = s->emu_state;
+    struct breakpoints *bps = es->breakpoints;
+    bool break_next = es->dbg_break_next;
+    u64 end = es->time_steps;
+    int i;
+
+    for (i = r->num - 1; i >= 0 && reverse_snap(r, i)->step >= end; i--)
+        ;
+    if (i < 0) {
+        printf("No earlier history to go back to.\n");
+        return 1;
+    }
+
+    bps->quiet = 1;
+    es->dbg_break_next = 0;
+    for (; i >= 0; i--) {
+        struct reverse_snapshot *snap = reverse_snap(r, i);
+        u64 found = reverse_scan(r, s, snap, end, mode);
+        if (found != REVERSE_NONE) {
+            size_t input = reverse_restore(r, s, snap);
+            while (es->time_steps < found)
+                reverse_replay_step(r, s, &input);
+            es->dbg_break_next = 0;
+            break;
+        }
+        end = snap->step;
+    }
+    if (i < 0) {
+        reverse_restore(r, s, reverse_snap(r, 0));
+        printf("Reached the oldest snapshot.\n");
+    }
+    bps->quiet = 0;
+    bps->watch_hit = 0;
+    es->dbg_break_next = break_next;
+
+    reverse_truncate(r, s);
+    return 0;
+}
+
+int reverse_step(struct reverse *r, struct gb_state *s) {
+    return reverse_go(r, s, REVERSE_STEP);
+}
+
+int reverse_continue(struct reverse *r, struct gb_state *s) {
+    return reverse_go(r, s, REVERSE_CONTINUE);
+}
@@ -0,0 +1,32 @@
+#ifndef REVERSE_H
+#define REVERSE_H
+
+#include "types.h"
+
+/*
+ * Reverse execution for the debugger. Every `interval` frames a snapshot of
+ * the machine (registers, I/O and RAM, but not the ROM) is kept in memory,
+ * along with the buttons pressed in between. Going back restores an earlier
+ * snapshot and replays deterministically up to the target, counted in
+ * emu_steps (time_steps). Only the last REVERSE_MAX_SNAPSHOTS are kept.
+ */
+#define REVERSE_MAX_SNAPSHOTS 1024
+#define REVERSE_DEFAULT_INTERVAL 60
+
+struct reverse;
+
+struct reverse *reverse_new(unsigned interval);
+
+/* Call at the start of every frame. */
+void reverse_frame(struct reverse *r, struct gb_state *s);
+
+/* Call after every change of the buttons (emu_process_inputs). */
+void reverse_input(struct reverse *r, struct gb_state *s);
+
+/* Go back to just before the previous instruction, or to the previous
+ * breakpoint or watchpoint hit (the oldest snapshot if there is none).
+ * Returns 1 if there's no history to go back to. */
+int reverse_step(struct reverse *r, struct gb_state *s);
+int reverse_continue(struct reverse *r, struct gb_state *s);
+
+#endif
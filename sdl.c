@@ -1,5 +1,7 @@
 #include <assert.h>
 #include <stdlib.h>
+#include <stdatomic.h>
+#include <string.h>
 
 #include <SDL2/SDL.h>
 
@@ -11,14 +13,60 @@ static SDL_AudioDeviceID audio_dev;
 
 static int lcd_width, lcd_height;
 
-/* Called by SDL when it needs more samples. */
-void audio_callback(void *userdata, uint8_t *stream, int len) {
-    uint8_t *sndbuf = userdata;
-    memcpy(stream, sndbuf, len);
+/*
+ * Samples go from the emulator to SDL's audio thread through a lock-free
+ * single-producer single-consumer ring. Each side only writes its own index
+ * (head for the emulator, tail for the audio thread) and publishes it with
+ * release semantics after copying the samples, so neither side ever waits for
+ * the other.
+ */
+#define AUDIO_RING_SIZE 8192 /* In (stereo) samples, must be a power of 2. */
+static int audio_channels;
+static int16_t *audio_ring;
+static atomic_size_t audio_ring_head;
+static atomic_size_t audio_ring_tail;
+static atomic_uint audio_underruns; /* Callbacks that ran out of samples. */
+static atomic_uint audio_overruns; /* Pushes that didn't fit in the ring. */
+
+/* Copy n samples between the ring (at index pos) and buf, in either
+ * direction, taking care of wrapping around the end of the ring. */
+static void audio_ring_copy(int16_t *buf, size_t pos, size_t n, bool to_ring) {
+    size_t start = pos & (AUDIO_RING_SIZE - 1);
+    size_t first = n < AUDIO_RING_SIZE - start ? n : AUDIO_RING_SIZE - start;
+    size_t sample_size = audio_channels * sizeof(int16_t);
+    int16_t *ring = &audio_ring[start * audio_channels];
+
+    if (to_ring) {
+        memcpy(ring, buf, first * sample_size);
+        memcpy(audio_ring, &buf[first * audio_channels],
+                (n - first) * sample_size);
+    } else {
+        memcpy(buf, ring, first * sample_size);
+        memcpy(&buf[first * audio_channels], audio_ring,
+                (n - first) * sample_size);
+    }
 }
 
-int gui_audio_init(int sample_rate, int channels, size_t sndbuf_size,
-        uint8_t *sndbuf) {
+/* Called by SDL (on its audio thread) when it needs more samples. */
+static void audio_callback(void *userdata, uint8_t *stream, int len) {
+    int16_t *out = (int16_t *)stream;
+    size_t want = len / (audio_channels * sizeof(int16_t));
+    size_t tail = atomic_load_explicit(&audio_ring_tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&audio_ring_head, memory_order_acquire);
+    size_t n = head - tail < want ? head - tail : want;
+    (void)userdata;
+
+    audio_ring_copy(out, tail, n, false);
+    atomic_store_explicit(&audio_ring_tail, tail + n, memory_order_release);
+
+    if (n < want) {
+        memset(&out[n * audio_channels], 0,
+                (want - n) * audio_channels * sizeof(int16_t));
+        atomic_fetch_add_explicit(&audio_underruns, 1, memory_order_relaxed);
+    }
+}
+
+int gui_audio_init(int sample_rate, int channels) {
     SDL_AudioSpec want, have;
 
     if (SDL_InitSubSystem(SDL_INIT_AUDIO)) {
@@ -28,11 +76,16 @@ int gui_audio_init(int sample_rate, int channels, size_t sndbuf_size,
 
     SDL_memset(&want, 0, sizeof(want));
     want.freq = sample_rate;
-    want.format = AUDIO_U8;
+    want.format = AUDIO_S16SYS;
     want.channels = channels;
-    want.samples = sndbuf_size * channels;
+    want.samples = 1024;
     want.callback = audio_callback;
-    want.userdata = sndbuf;
+
+    audio_channels = channels;
+    audio_ring = calloc(AUDIO_RING_SIZE * channels, sizeof(int16_t));
+    if (!audio_ring)
+        return 1;
+
     audio_dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
     if (!audio_dev) {
         printf("SDL: failed to open sound device: %s\n", SDL_GetError());
@@ -42,6 +95,37 @@ int gui_audio_init(int sample_rate, int channels, size_t sndbuf_size,
     return 0;
 }
 
+void gui_audio_queue(int16_t *samples, int num_samples) {
+    size_t head = atomic_load_explicit(&audio_ring_head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&audio_ring_tail, memory_order_acquire);
+    size_t space = AUDIO_RING_SIZE - (head - tail);
+    size_t n = num_samples;
+
+    if (n > space) {
+        n = space;
+        atomic_fetch_add_explicit(&audio_overruns, 1, memory_order_relaxed);
+    }
+
+    audio_ring_copy(samples, head, n, true);
+    atomic_store_explicit(&audio_ring_head, head + n, memory_order_release);
+}
+
+void gui_audio_stats(unsigned *underruns, unsigned *overruns) {
+    *underruns = atomic_load_explicit(&audio_underruns, memory_order_relaxed);
+    *overruns = atomic_load_explicit(&audio_overruns, memory_order_relaxed);
+}
+
+int gui_audio_buffered(void) {
+    size_t head = atomic_load_explicit(&audio_ring_head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&audio_ring_tail, memory_order_relaxed);
+    return head - tail;
+}
+
+void gui_sleep(double seconds) {
+    if (seconds > 0)
+        SDL_Delay(seconds * 1000);
+}
+
 
 int gui_lcd_init(int width, int height, int zoom, char *wintitle) {
     SDL_Window *window;
@@ -82,7 +166,7 @@ int gui_lcd_init(int width, int height, int zoom, char *wintitle) {
 }
 
 
-void gui_lcd_render_frame(char use_colors, uint16_t *pixbuf) {
+static void lcd_update_texture(char use_colors, uint16_t *pixbuf) {
     uint32_t *pixels = NULL;
     int pitch;
     if (SDL_LockTexture(texture, NULL, (void*)&pixels, &pitch)) {
@@ -118,10 +202,14 @@ void gui_lcd_render_frame(char use_colors, uint16_t *pixbuf) {
     }
 
     SDL_UnlockTexture(texture);
+}
+
+void gui_lcd_render_frame(char use_colors, uint16_t *pixbuf) {
+    if (pixbuf)
+        lcd_update_texture(use_colors, pixbuf);
+
     SDL_RenderCopy(renderer, texture, NULL, NULL);
     SDL_RenderPresent(renderer);
-
-    SDL_Delay(1000/120);
 }
 
 int gui_input_poll(struct player_input *input) {
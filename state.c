@@ -275,7 +275,6 @@ void state_add_bios(struct gb_state *s, u8 *bios, size_t bios_size) {
  */
 void init_emu_state(struct gb_state *s) {
     s->emu_state = calloc(1, sizeof(struct emu_state));
-    s->emu_state->dbg_breakpoint = 0xffff;
 }
 
 /*
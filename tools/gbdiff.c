@@ -0,0 +1,152 @@
+/*
+ * Differential testing: runs a ROM and compares every instruction (registers,
+ * flags, cycle count) and, if the reference has them, every memory access
+ * with a trace recorded with --trace (e.g. by a trusted build), stopping at
+ * the first difference.
+ *
+ * Usage: gbdiff [option]... ROM TRACE
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "emu.h"
+#include "trace.h"
+#include "movie.h"
+
+/* Ring of our own records, compared after every step, so it must hold all
+ * records of a single step. The most is a 2 KiB general-purpose HDMA, which
+ * adds 4096 memory accesses to the instruction. */
+#define GBDIFF_RECORDS (1 << 14)
+#define GBDIFF_CONTEXT 16 /* Default number of matching records shown. */
+
+static void print_usage(char *progname) {
+    printf("Usage: %s [option]... ROM TRACE\n\n", progname);
+    printf("Runs ROM and compares its execution with TRACE (written with "
+            "--trace), printing\n");
+    printf("the first difference. Memory accesses are compared if TRACE "
+            "was recorded with\n");
+    printf("--trace-mmu. Exit status 1 if there is a difference.\n\n");
+    printf("Options:\n");
+    printf(" -l FILE            Start from a savestate (as with "
+            "--load-state).\n");
+    printf(" -p FILE            Play back a movie (as with --movie-play).\n");
+    printf(" -b FILE            Use the specified bios.\n");
+    printf(" -c N               Show the last N matching records (default "
+            "%d).\n", GBDIFF_CONTEXT);
+}
+
+static void print_difference(struct trace *ref, struct trace *ours, u64 i,
+        u64 context) {
+    u64 first = trace_first(ref) > trace_first(ours) ?
+        trace_first(ref) : trace_first(ours);
+
+    if (i - first > context)
+        first = i - context;
+    printf("First difference at record %llu:\n", (unsigned long long)i);
+    for (u64 j = first; j < i; j++) {
+        printf("   ");
+        trace_print_record(trace_get(ours, j));
+    }
+    printf("-  ");
+    trace_print_record(trace_get(ref, i));
+    printf("+  ");
+    trace_print_record(trace_get(ours, i));
+}
+
+int main(int argc, char *argv[]) {
+    struct emu_args args;
+    struct movie *movie = NULL;
+    char *movie_filename = NULL;
+    u64 context = GBDIFF_CONTEXT;
+    int opt;
+
+    memset(&args, 0, sizeof(args));
+    while ((opt = getopt(argc, argv, "l:p:b:c:")) != -1) {
+        switch (opt) {
+        case 'l': args.state_filename = optarg; break;
+        case 'p': movie_filename = optarg; break;
+        case 'b': args.bios_filename = optarg; break;
+        case 'c': context = strtoull(optarg, NULL, 0); break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    args.rom_filename = argv[optind];
+
+    struct trace *ref = trace_load(argv[optind + 1]);
+    if (!ref)
+        return 1;
+
+    if (movie_filename) {
+        if (!(movie = movie_play(movie_filename)))
+            return 1;
+        movie_anchor(movie, &args.state_buf, &args.state_buf_size);
+        if (!args.state_buf)
+            args.no_save_load = 1;
+    }
+
+    struct gb_state gb_state;
+    memset(&gb_state, 0, sizeof(gb_state));
+    if (emu_init(&gb_state, &args))
+        return 1;
+    if (movie && movie_check_rom(movie, &gb_state))
+        return 1;
+
+    struct emu_state *es = gb_state.emu_state;
+    struct trace *ours = trace_open(NULL, GBDIFF_RECORDS, trace_has_mmu(ref));
+    if (!ours)
+        return 1;
+    es->trace = ours;
+    es->trace_mmu = trace_has_mmu(ref);
+
+    /* The reference may have lost its oldest records, so only compare from
+     * the first one it still has. */
+    u64 start = trace_first(ref), end = trace_written(ref);
+    struct player_input input;
+    memset(&input, 0, sizeof(input));
+
+    for (u64 i = 0; i < end && !es->quit; ) {
+        emu_step(&gb_state);
+
+        if (trace_written(ours) - i > GBDIFF_RECORDS) {
+            printf("Too many records in one step (%llu) to compare.\n",
+                    (unsigned long long)(trace_written(ours) - i));
+            return 1;
+        }
+        for (; i < trace_written(ours) && i < end; i++) {
+            if (i >= start && memcmp(trace_get(ours, i), trace_get(ref, i),
+                        sizeof(struct trace_record))) {
+                print_difference(ref, ours, i, context);
+                return 1;
+            }
+        }
+
+        if (movie && es->lcd_entered_vblank && movie_input(movie, &input)) {
+            movie_close(movie);
+            movie = NULL;
+        }
+        if (es->lcd_entered_vblank)
+            emu_process_inputs(&gb_state, &input);
+    }
+
+    if (trace_written(ours) < end) {
+        printf("Emulation stopped at record %llu, before the end of the "
+                "trace.\n", (unsigned long long)trace_written(ours));
+        return 1;
+    }
+    printf("No differences in %llu records (cycles %llu-%llu).\n",
+            (unsigned long long)(end - start),
+            (unsigned long long)(end > start ? trace_get(ref, start)->cycle : 0),
+            (unsigned long long)(end > start ? trace_get(ref, end - 1)->cycle :
+                                 0));
+    return 0;
+}
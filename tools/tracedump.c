@@ -0,0 +1,119 @@
+/*
+ * Prints (a filtered part of) a binary execution trace written with --trace,
+ * disassembling the instructions.
+ *
+ * Usage: tracedump [option]... FILE
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+struct range {
+    bool set;
+    u64 from, to; /* Inclusive. */
+};
+
+struct filter {
+    u64 last; /* Only the last N records, 0 for all. */
+    bool insns_only;
+    bool mem_only;
+    int bank; /* -1 for any. */
+    struct range pc;
+    struct range addr;
+    struct range cycle;
+};
+
+static void print_usage(char *progname) {
+    printf("Usage: %s [option]... FILE\n\n", progname);
+    printf("Prints a binary execution trace (written with --trace).\n\n");
+    printf("Options:\n");
+    printf(" -n N               Only the last N records.\n");
+    printf(" -p PC[-PC]         Only records of instructions at these "
+            "addresses.\n");
+    printf(" -b BANK            Only records of instructions in this bank.\n");
+    printf(" -a ADDR[-ADDR]     Only memory accesses to these addresses.\n");
+    printf(" -c CYCLE[-CYCLE]   Only records in this range of emulated "
+            "cycles.\n");
+    printf(" -i                 Only instructions (and interrupts).\n");
+    printf(" -m                 Only memory accesses.\n");
+}
+
+static int parse_range(const char *arg, struct range *r) {
+    char *end;
+
+    r->from = strtoull(arg, &end, 0);
+    r->to = r->from;
+    if (*end == '-')
+        r->to = strtoull(end + 1, &end, 0);
+    r->set = 1;
+    return *end != '\0' || r->to < r->from;
+}
+
+static bool in_range(struct range *r, u64 value) {
+    return !r->set || (value >= r->from && value <= r->to);
+}
+
+static bool filter_match(struct filter *f, const struct trace_record *r) {
+    bool mem = r->kind == TRACE_READ || r->kind == TRACE_WRITE;
+
+    if ((f->insns_only && mem) || (f->mem_only && !mem))
+        return 0;
+    if (!in_range(&f->cycle, r->cycle) || !in_range(&f->pc, r->pc))
+        return 0;
+    if (f->addr.set && (!mem || !in_range(&f->addr, r->addr)))
+        return 0;
+    if (f->bank >= 0 && (r->kind != TRACE_INSN || r->bank != f->bank))
+        return 0;
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    struct filter f;
+    int opt;
+
+    memset(&f, 0, sizeof(f));
+    f.bank = -1;
+
+    while ((opt = getopt(argc, argv, "n:p:b:a:c:im")) != -1) {
+        int err = 0;
+        switch (opt) {
+        case 'n': f.last = strtoull(optarg, NULL, 0); break;
+        case 'p': err = parse_range(optarg, &f.pc); break;
+        case 'b': f.bank = strtol(optarg, NULL, 0); break;
+        case 'a': err = parse_range(optarg, &f.addr); break;
+        case 'c': err = parse_range(optarg, &f.cycle); break;
+        case 'i': f.insns_only = 1; break;
+        case 'm': f.mem_only = 1; break;
+        default: err = 1;
+        }
+        if (err) {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    struct trace *t = trace_load(argv[optind]);
+    if (!t)
+        return 1;
+
+    u64 first = trace_first(t);
+    if (f.last && trace_written(t) - first > f.last)
+        first = trace_written(t) - f.last;
+
+    for (u64 i = first; i < trace_written(t); i++) {
+        const struct trace_record *r = trace_get(t, i);
+        if (filter_match(&f, r))
+            trace_print_record(r);
+    }
+    return 0;
+}
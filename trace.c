@@ -0,0 +1,241 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+#include "hwdefs.h"
+#include "cpu.h"
+#include "mmu.h"
+#include "disassembler.h"
+
+_Static_assert(sizeof(struct trace_record) == 32, "trace record size");
+
+struct trace {
+    struct trace_header *header;
+    struct trace_record *records;
+    u16 insn_pc;
+    u8 insn_len; /* Reads of these bytes from insn_pc are fetches. */
+    bool in_step;
+};
+
+struct trace *trace_open(const char *filename, u64 capacity, bool mmu) {
+    if (!capacity || capacity > (SIZE_MAX - sizeof(struct trace_header)) /
+            sizeof(struct trace_record))
+        return NULL;
+
+    struct trace *t = calloc(1, sizeof(struct trace));
+    size_t size = sizeof(struct trace_header) +
+        capacity * sizeof(struct trace_record);
+
+    if (!t)
+        return NULL;
+
+    void *map;
+    if (filename) {
+        int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "Couldn't open %s for writing\n", filename);
+            free(t);
+            return NULL;
+        }
+        if (ftruncate(fd, size)) {
+            fprintf(stderr, "Couldn't resize %s to %zu bytes\n", filename,
+                    size);
+            close(fd);
+            free(t);
+            return NULL;
+        }
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Couldn't map %s\n", filename);
+            free(t);
+            return NULL;
+        }
+    } else if (!(map = calloc(1, size))) {
+        free(t);
+        return NULL;
+    }
+
+    t->header = map;
+    t->records = (struct trace_record *)(t->header + 1);
+    memcpy(t->header->magic, TRACE_MAGIC, 4);
+    t->header->version = TRACE_VERSION;
+    t->header->record_size = sizeof(struct trace_record);
+    t->header->flags = mmu ? TRACE_FLAG_MMU : 0;
+    t->header->capacity = capacity;
+    t->header->written = 0;
+    return t;
+}
+
+struct trace *trace_load(const char *filename) {
+    struct trace *t = calloc(1, sizeof(struct trace));
+    struct stat st;
+
+    if (!t)
+        return NULL;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st)) {
+        fprintf(stderr, "Couldn't open %s\n", filename);
+        if (fd >= 0)
+            close(fd);
+        free(t);
+        return NULL;
+    }
+    if ((size_t)st.st_size < sizeof(struct trace_header)) {
+        fprintf(stderr, "%s is not a trace\n", filename);
+        close(fd);
+        free(t);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Couldn't map %s\n", filename);
+        free(t);
+        return NULL;
+    }
+
+    /* Divide rather than multiply, so a bogus capacity can't overflow. */
+    struct trace_header *h = map;
+    if (memcmp(h->magic, TRACE_MAGIC, 4) || h->version != TRACE_VERSION ||
+            h->record_size != sizeof(struct trace_record) || !h->capacity ||
+            h->capacity > ((size_t)st.st_size - sizeof(*h)) /
+                sizeof(struct trace_record)) {
+        fprintf(stderr, "%s is not a (supported) trace\n", filename);
+        munmap(map, st.st_size);
+        free(t);
+        return NULL;
+    }
+    t->header = h;
+    t->records = (struct trace_record *)(h + 1);
+    return t;
+}
+
+/* Fill in the common fields of the next record. It's only counted as written
+ * by trace_commit, after it's complete. */
+static struct trace_record *trace_record(struct trace *t, struct gb_state *s,
+        enum trace_kind kind) {
+    struct trace_record *r =
+        &t->records[t->header->written % t->header->capacity];
+
+    memset(r, 0, sizeof(struct trace_record));
+    r->cycle = (u64)s->emu_state->time_seconds * GB_FREQ +
+        s->emu_state->time_cycles;
+    r->kind = kind;
+    r->pc = t->insn_pc;
+    r->sp = s->sp;
+    return r;
+}
+
+static void trace_commit(struct trace *t) {
+    t->header->written++;
+}
+
+void trace_step(struct trace *t, struct gb_state *s) {
+    u16 vector = cpu_next_interrupt(s);
+    struct trace_record *r;
+
+    if (vector) {
+        t->insn_pc = s->pc; /* Return address. */
+        r = trace_record(t, s, TRACE_INTERRUPT);
+        r->addr = vector;
+        trace_commit(t);
+        t->insn_pc = vector;
+    } else if (!cpu_executes(s)) {
+        /* Nothing is executed, but cpu_step still reads the opcode. */
+        t->insn_pc = s->pc;
+        t->insn_len = mmu_read(s, s->pc) == 0xcb ? 2 : 1;
+        t->in_step = 1;
+        return;
+    } else {
+        t->insn_pc = s->pc;
+    }
+
+    r = trace_record(t, s, TRACE_INSN);
+    r->bank = mmu_bank(s, t->insn_pc);
+    for (int i = 0; i < DISASSEMBLE_MAX_LEN; i++)
+        r->bytes[i] = mmu_read(s, t->insn_pc + i);
+    t->insn_len = disassemble_bytes(r->bytes, NULL, 0);
+    r->a = s->reg8.A;
+    r->f = s->reg8.F;
+    r->b = s->reg8.B;
+    r->c = s->reg8.C;
+    r->d = s->reg8.D;
+    r->e = s->reg8.E;
+    r->h = s->reg8.H;
+    r->l = s->reg8.L;
+    trace_commit(t);
+
+    /* Only now, so our own reads above aren't recorded. */
+    t->in_step = 1;
+}
+
+void trace_end_step(struct trace *t) {
+    t->in_step = 0;
+}
+
+void trace_mem(struct trace *t, struct gb_state *s, enum trace_kind kind,
+        u16 addr, u8 value) {
+    if (!t->in_step)
+        return;
+    /* The CPU may read an immediate more than once, so skip every read of
+     * the instruction's own bytes (but not of the ones after it). */
+    if (kind == TRACE_READ && (u16)(addr - t->insn_pc) < t->insn_len)
+        return;
+
+    struct trace_record *r = trace_record(t, s, kind);
+    r->bank = mmu_bank(s, addr);
+    r->addr = addr;
+    r->value = value;
+    trace_commit(t);
+}
+
+u64 trace_first(struct trace *t) {
+    struct trace_header *h = t->header;
+    return h->written > h->capacity ? h->written - h->capacity : 0;
+}
+
+u64 trace_written(struct trace *t) {
+    return t->header->written;
+}
+
+bool trace_has_mmu(struct trace *t) {
+    return t->header->flags & TRACE_FLAG_MMU;
+}
+
+const struct trace_record *trace_get(struct trace *t, u64 i) {
+    return &t->records[i % t->header->capacity];
+}
+
+void trace_print_record(const struct trace_record *r) {
+    char buf[64];
+
+    printf("%12llu  ", (unsigned long long)r->cycle);
+    switch (r->kind) {
+    case TRACE_INSN:
+        disassemble_bytes(r->bytes, buf, sizeof(buf));
+        printf("%02x:%04x  %-20s AF=%02x%02x BC=%02x%02x DE=%02x%02x "
+                "HL=%02x%02x SP=%04x\n", r->bank, r->pc, buf, r->a, r->f,
+                r->b, r->c, r->d, r->e, r->h, r->l, r->sp);
+        break;
+    case TRACE_READ:
+        printf("           read  %02x:%04x -> %02x\n", r->bank, r->addr,
+                r->value);
+        break;
+    case TRACE_WRITE:
+        printf("           write %02x:%04x <- %02x\n", r->bank, r->addr,
+                r->value);
+        break;
+    case TRACE_INTERRUPT:
+        printf("        interrupt %04x (from %04x)\n", r->addr, r->pc);
+        break;
+    default:
+        printf("unknown record kind %d\n", r->kind);
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "types.h"
+
+/*
+ * Binary execution traces: a fixed-size record for every executed instruction
+ * (and optionally every memory access) in a ring in a memory-mapped file, so
+ * only the last records are kept. The header is updated with every record, so
+ * the trace survives the emulator crashing. Use tools/tracedump to read them.
+ *
+ * File format, in host byte order: a struct trace_header, followed by
+ * `capacity` struct trace_records. Record i (counting from the first one ever
+ * written) is stored at index i % capacity.
+ */
+#define TRACE_MAGIC "GBTR"
+#define TRACE_VERSION 2
+#define TRACE_DEFAULT_RECORDS (1 << 20)
+
+#define TRACE_FLAG_MMU (1 << 0) /* Memory accesses are recorded. */
+
+enum trace_kind {
+    TRACE_INSN,
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_INTERRUPT, /* Dispatch to the handler at addr. */
+};
+
+struct trace_header {
+    char magic[4];
+    u32 version;
+    u32 record_size;
+    u32 flags; /* TRACE_FLAG_* */
+    u64 capacity; /* Records in the ring. */
+    u64 written; /* Total records written. */
+};
+
+struct trace_record {
+    u64 cycle; /* Emulated cycles since power-on (or the loaded state). */
+    u8 kind; /* enum trace_kind */
+    u8 bytes[3]; /* Instruction (TRACE_INSN). */
+    u16 bank; /* Of pc (TRACE_INSN) or addr, see mmu_bank. */
+    u16 pc; /* Instruction being executed. */
+    u16 sp;
+    u16 addr; /* Memory access or interrupt vector. */
+    u8 value; /* Read or written. */
+    u8 a, f, b, c, d, e, h, l;
+    u8 reserved[3];
+};
+
+struct trace;
+
+/* Create the trace file (truncating it), holding the last `capacity` records,
+ * or only keep it in memory if filename is NULL. With mmu, memory accesses
+ * (trace_mem) are recorded as well. Returns NULL on failure. */
+struct trace *trace_open(const char *filename, u64 capacity, bool mmu);
+
+/* Open an existing trace file for reading. Returns NULL (printing why) if it
+ * isn't a supported trace. */
+struct trace *trace_load(const char *filename);
+
+/* Call before and after every emulated step. Memory accesses in between are
+ * recorded, those by the debugger and such are not. */
+void trace_step(struct trace *t, struct gb_state *s);
+void trace_end_step(struct trace *t);
+
+/* Memory accesses, except fetching the instruction bytes. Accesses while
+ * dispatching an interrupt follow the first instruction of the handler. */
+void trace_mem(struct trace *t, struct gb_state *s, enum trace_kind kind,
+        u16 addr, u8 value);
+
+/* The ring holds records [trace_first, trace_written). */
+u64 trace_first(struct trace *t);
+u64 trace_written(struct trace *t);
+bool trace_has_mmu(struct trace *t);
+const struct trace_record *trace_get(struct trace *t, u64 i);
+
+/* Print a record on one line, disassembling instructions. */
+void trace_print_record(const struct trace_record *r);
+
+#endif
@@ -19,17 +19,31 @@ typedef int64_t s64;
 #define FLAG_N 0x40
 #define FLAG_Z 0x80
 
+/* How (and when) LCD lines are rendered into lcd_pixbuf. */
+enum lcd_render_mode {
+    LCD_RENDER_IMMEDIATE, /* Render each line at the start of its H-Blank. */
+    LCD_RENDER_DEFERRED,  /* Log writes, render the whole frame at V-Blank. */
+    LCD_RENDER_THREADED,  /* Render on a separate thread, wait at V-Blank. */
+    LCD_RENDER_PIPELINED, /* Like threaded, but show frames one frame late so
+                             rendering overlaps with emulating the next one. */
+};
+
 /* State of the emulator itself, not of the hardware. */
 struct emu_state {
     bool quit;
     bool make_savestate;
 
     bool audio_enable;
-    u8 *audio_sndbuf;
+    s16 *audio_buf; /* Interleaved stereo samples generated this frame. */
+    int audio_buf_len; /* In stereo samples. */
+    u32 audio_cycles; /* Cycles the APU still has to catch up on. */
 
     bool lcd_entered_hblank; /* Set at the end of every HBlank. */
     bool lcd_entered_vblank; /* Set at the beginning of every VBlank. */
+    bool lcd_render_skip; /* Don't render lines, LCD timing is unaffected. */
+    enum lcd_render_mode lcd_render_mode;
     u16 *lcd_pixbuf; /* 2-bit or 15-bit color per pixel. */
+    bool lcd_frame_dup; /* Last frame is identical to the one before it. */
 
     bool flush_extram; /* Flush battery-backed RAM when it's disabled. */
     bool extram_dirty; /* Write battery-backed RAM periodically when dirty. */
@@ -37,13 +51,26 @@ struct emu_state {
     bool dbg_break_next;
     bool dbg_print_disas;
     bool dbg_print_mmu;
-    u16 dbg_breakpoint;
+    bool dbg_mem_access; /* Memory accessed for the debugger (GDB): MMU errors
+                            only set dbg_mem_error instead of breaking. */
+    bool dbg_mem_error;
+    struct breakpoints *breakpoints; /* Only used in debug builds. */
+    struct gdb *gdb; /* Debugging via GDB instead of the prompt, or NULL. */
 
     u32 last_op_cycles; /* The duration of the last intruction. Normally just
                            the CPU executing the instruction, but the MMU could
                            take longer in the case of some DMA ops. */
     u32 time_cycles;
     u32 time_seconds;
+    u64 time_instructions; /* Executed by the CPU (not counting HALT). */
+    u64 time_steps; /* Calls to emu_step (instructions and HALT steps). */
+    u32 frame_cycles; /* Length of the last emu_step_frame. */
+
+    struct profile *profile; /* Guest code profiler, NULL if disabled. */
+    struct perf *perf; /* Host time measurement, NULL if disabled. */
+    struct trace *trace; /* Binary execution trace, NULL if disabled. */
+    bool trace_mmu; /* Also trace memory accesses. */
+    struct reverse *reverse; /* Snapshots for reverse execution, or NULL. */
 
     char state_filename_out[1024];
     char save_filename_out[1024];
@@ -52,11 +79,34 @@ struct emu_state {
 /* State of the cpu part of the emulation, not of the hardware. */
 struct emu_cpu_state;
 
+/* State of the lcd part of the emulation (renderer), not of the hardware. */
+struct emu_lcd_state;
+
+/* State of the audio output (synthesis), not of the hardware. */
+struct emu_audio_state;
+
+struct breakpoints;
+struct gdb;
+struct profile;
+struct perf;
+struct trace;
+struct reverse;
+
 enum gb_type {
     GB_TYPE_GB,
     GB_TYPE_CGB,
 };
 
+/* A sound channel as generated by the APU (see audio.c). */
+struct gb_sound_channel {
+    bool enabled; /* Reported in NR52, output is silent when not set. */
+    u16 length; /* Length counter, disables the channel when it expires. */
+    u8 volume; /* Current envelope volume (0-15). */
+    u8 env_timer; /* Envelope steps (1/64 s) until the next volume change. */
+    u32 freq_timer; /* Cycles until the next waveform step. */
+    u8 pos; /* Position in the duty waveform (ch1/2) or wave RAM (ch3). */
+};
+
 /* TODO split this up into module-managed components (cpu, mmu, ...) */
 struct gb_state {
 
@@ -202,6 +252,15 @@ struct gb_state {
     u8 io_sound_channel4_poly;
     u8 io_sound_channel4_consec_initial;
 
+    /* Internal APU state, not directly visible through the registers above. */
+    struct gb_sound_channel io_sound_ch[4];
+    u16 io_sound_ch1_sweep_freq; /* Shadow frequency register of the sweep. */
+    u8 io_sound_ch1_sweep_timer;
+    bool io_sound_ch1_sweep_enabled;
+    u16 io_sound_ch4_lfsr;
+    u8 io_sound_frame_seq_step; /* 0-7, length/sweep/envelope clocking. */
+    u32 io_sound_frame_seq_cycles; /* Until the next frame sequencer step. */
+
     /* CGB DMA transfers (HDMA) */
     u8 io_hdma_src_high, io_hdma_src_low;
     u8 io_hdma_dst_high, io_hdma_dst_low;
@@ -253,6 +312,8 @@ struct gb_state {
 
     struct emu_state *emu_state;
     struct emu_cpu_state *emu_cpu_state;
+    struct emu_lcd_state *emu_lcd_state;
+    struct emu_audio_state *emu_audio_state;
 };
 
 